@@ -0,0 +1,353 @@
+// Микробенчмарки горячих путей luabinder.hpp в сравнении с тем же кодом на чистом Lua C API.
+// Для каждого случая печатается время и число выделений памяти на один вызов: блоки распределителя Lua
+// вместе с operator new, через который политики хранения вроде GcPointerPolicy размещают объекты C++.
+// Собирается целью luabinder_bench из CMakeLists.txt в корне репозитория с закрепленной версией Lua 5.1.5.
+// Необязательный аргумент - множитель числа итераций (по умолчанию 1)
+#include "luabinder.hpp"
+#include <cstdio>
+#include <new>
+
+namespace
+{
+	// Выделения через глобальный operator new
+	std::size_t heapAllocations = 0;
+
+	inline void* countedMalloc(std::size_t size)
+	{
+		++heapAllocations;
+		return std::malloc(size ? size : 1);
+	}
+
+	inline void* countedNew(std::size_t size)
+	{
+		if (void* ptr = countedMalloc(size))
+			return ptr;
+		throw std::bad_alloc();
+	}
+
+	// Не встраивается в operator delete: иначе GCC видит free для памяти из operator new (-Wmismatched-new-delete)
+	BOOST_NOINLINE void countedFree(void* ptr)
+	{
+		std::free(ptr);
+	}
+}
+
+// Заменяется весь набор operator new/delete без выравнивания: обычные, массивы, nothrow и delete с размером.
+// Иначе часть объектов освобождалась бы не той функцией, которой выделена
+#ifdef BOOST_NO_CXX11_NOEXCEPT
+void* operator new(std::size_t size) throw (std::bad_alloc)
+#else
+void* operator new(std::size_t size)
+#endif
+{
+	return countedNew(size);
+}
+
+#ifdef BOOST_NO_CXX11_NOEXCEPT
+void* operator new[](std::size_t size) throw (std::bad_alloc)
+#else
+void* operator new[](std::size_t size)
+#endif
+{
+	return countedNew(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	return countedMalloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	return countedMalloc(size);
+}
+
+void operator delete(void* ptr) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+
+void operator delete[](void* ptr) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* ptr, std::size_t) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	countedFree(ptr);
+}
+#endif
+
+namespace
+{
+	// Распределитель контекста поверх realloc, считающий новые блоки
+	struct AllocCounter
+	{
+		std::size_t allocations;
+
+		AllocCounter() : allocations(0) {}
+
+		// Блоки Lua и объекты C++ вместе
+		inline std::size_t total() const
+		{
+			return allocations + heapAllocations;
+		}
+	};
+
+	void* countingAlloc(void* ud, void* ptr, size_t, size_t nsize)
+	{
+		if (nsize == 0)
+		{
+			std::free(ptr);
+			return 0;
+		}
+		if (!ptr)
+			++static_cast<AllocCounter*> (ud)->allocations;
+		return std::realloc(ptr, nsize);
+	}
+
+	struct Vec
+	{
+		float x, y;
+
+		Vec(float a = 0, float b = 0) : x(a), y(b) {}
+	};
+
+	int add(int a, int b)
+	{
+		return a + b;
+	}
+
+	float length2(const Vec* v)
+	{
+		return v->x * v->x + v->y * v->y;
+	}
+
+	Vec makeVec(float a)
+	{
+		return Vec(a, a);
+	}
+
+	Vec addVec(const Vec& l, const Vec& r)
+	{
+		return Vec(l.x + r.x, l.y + r.y);
+	}
+
+	// Ручные эквиваленты. RawVec хранит указатель на объект в куче, как GcPointerPolicy
+	const char* rawVecName = "RawVec";
+
+	Vec* rawCheckVec(lua_State* L, int idx)
+	{
+		return *static_cast<Vec**> (luaL_checkudata(L, idx, rawVecName));
+	}
+
+	void rawPushVec(lua_State* L, const Vec& v)
+	{
+		*static_cast<Vec**> (lua_newuserdata(L, sizeof (Vec*))) = new Vec(v);
+		luaL_getmetatable(L, rawVecName);
+		lua_setmetatable(L, -2);
+	}
+
+	int rawVecGc(lua_State* L)
+	{
+		delete *static_cast<Vec**> (lua_touserdata(L, 1));
+		return 0;
+	}
+
+	int rawVecNew(lua_State* L)
+	{
+		rawPushVec(L, Vec(static_cast<float> (luaL_checknumber(L, 1)), static_cast<float> (luaL_checknumber(L, 2))));
+		return 1;
+	}
+
+	int rawAdd(lua_State* L)
+	{
+		lua_pushinteger(L, luaL_checkinteger(L, 1) + luaL_checkinteger(L, 2));
+		return 1;
+	}
+
+	int rawLength2(lua_State* L)
+	{
+		lua_pushnumber(L, length2(rawCheckVec(L, 1)));
+		return 1;
+	}
+
+	int rawMakeVec(lua_State* L)
+	{
+		rawPushVec(L, makeVec(static_cast<float> (luaL_checknumber(L, 1))));
+		return 1;
+	}
+
+	int rawAddVec(lua_State* L)
+	{
+		rawPushVec(L, addVec(*rawCheckVec(L, 1), *rawCheckVec(L, 2)));
+		return 1;
+	}
+
+	struct Sample
+	{
+		double nanos;
+		double allocations;
+	};
+
+	// Замер: время и выделения на одну из iterations итераций
+	class Measure
+	{
+	public:
+		Measure(lua_State* L, const AllocCounter& counter) : m_counter(counter)
+		{
+			lua_gc(L, LUA_GCCOLLECT, 0);
+			m_allocations = counter.total();
+			m_start = TypeManagerDetail::monotonicNanos();
+		}
+
+		Sample stop(int iterations) const
+		{
+			Sample result;
+			result.nanos = static_cast<double> (TypeManagerDetail::monotonicNanos() - m_start) / iterations;
+			result.allocations = static_cast<double> (m_counter.total() - m_allocations) / iterations;
+			return result;
+		}
+
+	private:
+		const AllocCounter& m_counter;
+		std::size_t m_allocations;
+		boost::uint64_t m_start;
+	};
+
+	// Цикл Lua из iterations вызовов body. Фрагмент компилируется до замера
+	Sample runLoop(lua_State* L, const AllocCounter& counter, const char* setup, const char* body, int iterations)
+	{
+		std::ostringstream source;
+		source << setup << " for i = 1, " << iterations << " do " << body << " end";
+		if (luaL_loadstring(L, source.str().c_str()) != 0)
+			throw LuaSyntaxError(lua_tostring(L, -1));
+		Measure measure(L, counter);
+		if (lua_pcall(L, 0, 0, 0) != 0)
+			throw LuaRuntimeError(lua_tostring(L, -1));
+		return measure.stop(iterations);
+	}
+
+	void report(const char* name, const Sample& binder, const Sample& raw)
+	{
+		std::printf("%-34s %10.1f %10.1f %10.2f %10.2f\n", name, binder.nanos, raw.nanos, binder.allocations, raw.allocations);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const int scale = argc > 1 ? std::max(1, std::atoi(argv[1])) : 1;
+	const int calls = 1000000 * scale;
+	const int chunks = 100000 * scale;
+
+	AllocCounter counter;
+	lua_State* L = lua_newstate(& countingAlloc, &counter);
+	luaL_openlibs(L);
+	try
+	{
+		typedef LTypesManager::AddedType<Vec>::type Convertor;
+		LTypesManager root;
+		Convertor::pointer conv = root.registerType<Vec>("Vec", L);
+		LuaEngine<Convertor> engine(L, conv);
+		engine.regConstructor<Vec (float, float)>("Vec")
+			.regFunc("add", &add)
+			.regFunc("length2", &length2)
+			.regFunc("makeVec", &makeVec, GcPointerPolicy())
+			.regMeta("Vec", "__add", &addVec);
+
+		luaL_newmetatable(L, rawVecName);
+		lua_pushcfunction(L, & rawVecGc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, & rawAddVec);
+		lua_setfield(L, -2, "__add");
+		lua_pop(L, 1);
+		lua_register(L, "rawVec", & rawVecNew);
+		lua_register(L, "rawAdd", & rawAdd);
+		lua_register(L, "rawLength2", & rawLength2);
+		lua_register(L, "rawMakeVec", & rawMakeVec);
+
+		std::printf("%-34s %10s %10s %10s %10s\n", "case", "ns/call", "raw ns", "allocs", "raw allocs");
+
+		report("regFunc scalar arguments",
+			runLoop(L, counter, "local f = add", "f(i, 2)", calls),
+			runLoop(L, counter, "local f = rawAdd", "f(i, 2)", calls));
+
+		report("registered pointer argument",
+			runLoop(L, counter, "local f, v = length2, Vec(1, 2)", "f(v)", calls),
+			runLoop(L, counter, "local f, v = rawLength2, rawVec(1, 2)", "f(v)", calls));
+
+		report("by-value return, GcPointerPolicy",
+			runLoop(L, counter, "local f = makeVec", "f(i)", calls),
+			runLoop(L, counter, "local f = rawMakeVec", "f(i)", calls));
+
+		report("regMeta __add dispatch",
+			runLoop(L, counter, "local a, b = Vec(1, 2), Vec(3, 4)", "local c = a + b", calls),
+			runLoop(L, counter, "local a, b = rawVec(1, 2), rawVec(3, 4)", "local c = a + b", calls));
+
+		{
+			// Копии объекта в новых userdata из C++ и их сборка по мере роста кучи.
+			// Константная ссылка копируется, неконстантная передавалась бы как указатель на v
+			const Vec v(1, 2);
+			Measure binder(L, counter);
+			for (int i = 0; i < calls; ++i)
+			{
+				conv->pushToStack(L, v, GcPointerPolicy());
+				lua_pop(L, 1);
+			}
+			Sample binderSample = binder.stop(calls);
+			Measure raw(L, counter);
+			for (int i = 0; i < calls; ++i)
+			{
+				rawPushVec(L, v);
+				lua_pop(L, 1);
+			}
+			report("pushToStack churn with GC", binderSample, raw.stop(calls));
+		}
+
+		{
+			const char* source = "local t = {} for i = 1, 10 do t[i] = i * 2 end";
+			Measure binder(L, counter);
+			for (int i = 0; i < chunks; ++i)
+				execLuaString(L, source);
+			Sample binderSample = binder.stop(chunks);
+			LuaChunkCache cache(L);
+			Measure cached(L, counter);
+			for (int i = 0; i < chunks; ++i)
+				cache.exec(source);
+			Sample cachedSample = cached.stop(chunks);
+			Measure raw(L, counter);
+			for (int i = 0; i < chunks; ++i)
+			{
+				if (luaL_loadstring(L, source) != 0 || lua_pcall(L, 0, 0, 0) != 0)
+					throw LuaRuntimeError(lua_tostring(L, -1));
+			}
+			Sample rawSample = raw.stop(chunks);
+			report("execLuaString", binderSample, rawSample);
+			report("LuaChunkCache::exec", cachedSample, rawSample);
+		}
+	}
+	catch (LuaException& e)
+	{
+		std::fprintf(stderr, "%s\n", e.what.c_str());
+		lua_close(L);
+		return 1;
+	}
+	lua_close(L);
+	return 0;
+}
@@ -10,9 +10,9 @@
 // 1. DONE - Accept const references in pushToStack() functions. Save info about constness.
 // 1a. DONE - const char* as a special case.
 // 2. DONE - define various ownership policies
-// 3. Register constructors, perhaps via (typed)inPlaceFactory
+// 3. DONE - Register constructors, perhaps via (typed)inPlaceFactory
 // 4. DONE - Manage lua metatables, allow to register member functions.
-// 5. Add ability to call Lua functions from C++
+// 5. DONE - Add ability to call Lua functions from C++
 // 6. Добавить создание/просмотр/слежение за комплексными таблицами/переменными Lua из C++
 // 7. ... functors introspection...
 //////////////////////////////////////////////////////////////////////////
@@ -24,30 +24,99 @@
 #include <boost/mpl/find.hpp>
 #include <boost/mpl/logical.hpp>
 #include <boost/mpl/distance.hpp>
-#include <boost/mpl/pop_front.hpp>
-#include <boost/mpl/front.hpp>
-#include <boost/mpl/equal.hpp>
 #include <boost/mpl/contains.hpp>
+#include <boost/mpl/at.hpp>
+#include <boost/mpl/map.hpp>
+#include <boost/mpl/fold.hpp>
+#include <boost/mpl/insert.hpp>
+#include <boost/mpl/has_key.hpp>
+#include <boost/mpl/size.hpp>
+#include <boost/mpl/placeholders.hpp>
+#include <boost/mpl/for_each.hpp>
 #include <boost/noncopyable.hpp>
-#include <boost/function.hpp>
-#include <boost/fusion/include/cons.hpp>
-#include <boost/fusion/include/push_back.hpp>
-#include <boost/fusion/include/invoke.hpp>
-#include <boost/bind.hpp>
 #include <boost/function_types/parameter_types.hpp>
+#include <boost/function_types/result_type.hpp>
+#include <boost/function_types/function_arity.hpp>
 #include <boost/function_types/function_pointer.hpp>
+#include <boost/preprocessor/repetition.hpp>
+#include <boost/preprocessor/arithmetic/inc.hpp>
+#include <boost/preprocessor/control/expr_if.hpp>
+#include <boost/preprocessor/logical/not.hpp>
 #include <boost/utility/enable_if.hpp>
 #include <boost/type_traits.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/ref.hpp>
+#include <boost/config.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/tuple/tuple.hpp>
 #include <lua.hpp>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <fstream>
 #include <map>
+#include <list>
 #include <vector>
+#include <algorithm>
 #include <typeinfo>
+#include <limits>
+#include <utility>
+#ifndef BOOST_NO_CXX11_HDR_CHRONO
+#	include <chrono>
+#else
+#	include <ctime>
+#endif
+#if !defined(BOOST_NO_CXX11_HDR_TUPLE) && !defined(BOOST_NO_CXX11_VARIADIC_TEMPLATES)
+#	include <tuple>
+#	define LUABINDER_HAS_STD_TUPLE
+#endif
+// Пул контекстов LuaEnginePool использует Boost.Thread (нужна линковка с boost_thread), поэтому включается явно
+#ifdef LUABINDER_ENGINE_POOL
+#	include <boost/thread/thread.hpp>
+#	include <boost/thread/mutex.hpp>
+#	include <boost/thread/condition_variable.hpp>
+#	include <boost/function.hpp>
+#	include <deque>
+#endif
 
 namespace mpl = boost::mpl;
 
+// Максимальное число аргументов у регистрируемых функций
+#ifndef LUABINDER_MAX_ARITY
+#	define LUABINDER_MAX_ARITY 8
+#endif
+
+// Профилирование привязок: число вызовов, время, ошибки преобразования и созданные userdata
+// по зарегистрированным именам (LuaEngine::profile). Без LUABINDER_PROFILE код профилирования не компилируется.
+// Замыкания привязок получают запись профиля последним upvalue
+#ifdef LUABINDER_PROFILE
+#	define LUABINDER_PROFILE_UPVALUES 1
+#	define LUABINDER_PROFILE_RECORD(L, name) TypeManagerDetail::pushProfileRecord(L, name);
+#	define LUABINDER_PROFILE_UPVALUE(L) lua_pushvalue(L, -3); lua_remove(L, -4);
+#	define LUABINDER_PROFILE_ALLOC() ++this->allocatedUserdata
+#	define LUABINDER_PROFILE_BEGIN(record) TypeManagerDetail::ProfileCall profileCall(record, conv->userdataCount());
+#	define LUABINDER_PROFILE_RESULT(results) profileCall.finish(conv->userdataCount(), results)
+#	define LUABINDER_PROFILE_FAILED() profileCall.finish(conv->userdataCount(), 0);
+#	define LUABINDER_PROFILE_CATCH_CONVERT \
+		catch (LuaConvertError& e) \
+		{ \
+			profileCall.convertError(); \
+			TypeManagerDetail::pushErrorMessage(L, e); \
+		}
+#else
+#	define LUABINDER_PROFILE_UPVALUES 0
+#	define LUABINDER_PROFILE_RECORD(L, name)
+#	define LUABINDER_PROFILE_UPVALUE(L)
+#	define LUABINDER_PROFILE_ALLOC() ((void)0)
+#	define LUABINDER_PROFILE_BEGIN(record)
+#	define LUABINDER_PROFILE_RESULT(results) results
+#	define LUABINDER_PROFILE_FAILED()
+#	define LUABINDER_PROFILE_CATCH_CONVERT
+#endif
+
 template<class T>
 struct remove_cv_ref: boost::remove_cv< typename boost::remove_reference<T>::type > {};
 
@@ -79,6 +148,12 @@ struct LuaRuntimeError : LuaException
 	LuaRuntimeError(const std::string & w) : LuaException(w) {}
 };
 
+// Скрипт прерван LuaWatchdog: исчерпан бюджет инструкций или времени
+struct LuaBudgetError : LuaRuntimeError
+{
+	LuaBudgetError(const std::string & w) : LuaRuntimeError(w) {}
+};
+
 struct LuaConvertError : LuaException
 {
 	LuaConvertError(int argn, const std::string & ttype): LuaException("")
@@ -140,6 +215,42 @@ struct GcPointerPolicy
 	};
 };
 
+// 3. Объект хранится по значению прямо в userdata Lua, рядом с DataHolder.
+// Одно выделение памяти на объект, деструктор вызывается при дергании __gc Lua.
+// При передаче указателя объект копируется
+
+struct InPlacePolicy
+{
+	template <class T>
+	struct apply : SimplePointerPolicy::apply<T>
+	{
+		static inline void onMetaGc(void* holder)
+		{
+			SimplePointerPolicy::apply<T>::getHoldee(holder)->~T();
+		}
+	};
+};
+
+// 4. Как SimplePointerPolicy, но повторная передача того же указателя возвращает тот же userdata.
+// Объекты можно использовать как ключи таблиц и сравнивать через ==.
+// Кэш слабый по значениям, при удалении объекта в C++ нужно вызвать LuaEngine::forgetObject
+
+struct CachedPointerPolicy
+{
+	template <class T>
+	struct apply : SimplePointerPolicy::apply<T> {};
+};
+
+// 5. Заимствованный указатель, временем жизни объекта полностью управляет C++.
+// Userdata содержит только указатель и тег типа, метатаблица без __gc:
+// создание почти бесплатно, сборщику мусора нечего финализировать
+
+struct BorrowedPointerPolicy
+{
+	template <class T>
+	struct apply : SimplePointerPolicy::apply<T> {};
+};
+
 struct StdPointerPolicy { template<class T> struct apply {};};
 
 namespace TypeManagerDetail
@@ -155,10 +266,40 @@ namespace TypeManagerDetail
 		}
 	};
 
+	// Закрепляет значение с индексом idx в таблице LUABINDER_Alloc реестра данного контекста,
+	// чтобы оно не было удалено сборщиком мусора. Возвращает номер слота для releaseLuaSpace.
+	// Слоты выдаются через luaL_ref, освобожденные номера используются повторно
+	inline int anchorLuaSpace(lua_State *state, int idx)
+	{
+		if (idx < 0 && idx > LUA_REGISTRYINDEX)
+			idx = lua_gettop(state) + idx + 1;
+		lua_getfield(state, LUA_REGISTRYINDEX, "LUABINDER_Alloc"); // Lua Stack +1 table
+		if (!lua_istable(state, -1))
+		{
+			// The table is not created yet
+			lua_pop(state, 1); // Lua Stack 0
+			lua_newtable(state); // Lua Stack +1 table
+			lua_pushvalue(state, -1); // Lua Stack +2 table table
+			lua_setfield(state, LUA_REGISTRYINDEX, "LUABINDER_Alloc"); // Lua Stack +1 table
+		}
+		lua_pushvalue(state, idx); // Lua Stack +2 table value
+		int anchor = luaL_ref(state, -2); // Lua Stack +1 table
+		lua_pop(state, 1); // Lua Stack 0
+		return anchor;
+	}
+
+	// Снимает закрепление, после чего объект может быть собран
+	inline void releaseLuaSpace(lua_State *state, int anchor)
+	{
+		lua_getfield(state, LUA_REGISTRYINDEX, "LUABINDER_Alloc"); // Lua Stack +1 table
+		if (lua_istable(state, -1))
+			luaL_unref(state, -1, anchor);
+		lua_pop(state, 1); // Lua Stack 0
+	}
+
 	template <class T>
 	void* allocateLuaSpace(lua_State *state, const char *tname, bool saveit = true)
 	{
-		static unsigned int curindex = 1;
 		void *result = lua_newuserdata(state, sizeof (T)); // Lua Stack +1 udata
 		if (luaL_newmetatable(state, tname)) // Lua Stack +2 udata meta
 		{
@@ -174,23 +315,393 @@ namespace TypeManagerDetail
 		if (saveit)
 		{
 			//Ensure that the object will not be deleted by saving its reference into a table in the registry
-			lua_getfield(state, LUA_REGISTRYINDEX, "LUABINDER_Alloc"); // Lua Stack +2 udata table
-			if (!lua_istable(state, -1))
+			anchorLuaSpace(state, -1);
+			lua_pop(state, 1); // Lua Stack 0
+		}
+		// Lua Stack +1 udata if not saved, 0 otherwise
+		return result;
+	}
+
+	// Восстанавливает вершину стека Lua при выходе из области видимости, в том числе по исключению
+	struct StackGuard : boost::noncopyable
+	{
+		lua_State* state;
+		int top;
+
+		StackGuard(lua_State* L) : state(L), top(lua_gettop(L)) {}
+		~StackGuard() { lua_settop(state, top); }
+	};
+
+	// Сообщение об ошибке для lua_error. Вызывается внутри catch, сам lua_error - после выхода из него,
+	// чтобы longjmp не проходил через живое исключение C++
+	inline void pushErrorMessage(lua_State* L, const LuaException& e)
+	{
+		luaL_where(L, 1);
+		lua_pushstring(L, e.what.c_str());
+		lua_concat(L, 2);
+	}
+
+	// Монотонные часы, наносекунды от произвольной точки
+	inline boost::uint64_t monotonicNanos()
+	{
+#ifndef BOOST_NO_CXX11_HDR_CHRONO
+		return static_cast<boost::uint64_t> (std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+#elif defined(BOOST_HAS_CLOCK_GETTIME)
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<boost::uint64_t> (ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#else
+		return static_cast<boost::uint64_t> (std::clock()) * (1000000000u / CLOCKS_PER_SEC);
+#endif
+	}
+
+	// Бюджеты контекста, см. LuaWatchdog. Пределы абсолютные: значение executed и момент monotonicNanos,
+	// максимум uint64 - предела нет
+	struct WatchdogData
+	{
+		int interval;
+		boost::uint64_t executed;
+		boost::uint64_t stateInstructions;
+		boost::uint64_t stateDeadline;
+		boost::uint64_t callInstructions;
+		boost::uint64_t callDeadline;
+		// Задан хотя бы один бюджет, хук должен стоять на всех выполняющихся потоках
+		bool active;
+		bool tripped;
+	};
+
+	inline WatchdogData* watchdogData(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LUABINDER_Watchdog"); // Lua Stack +1 data|nil
+		WatchdogData* data = reinterpret_cast<WatchdogData*> (lua_touserdata(L, -1));
+		lua_pop(L, 1); // Lua Stack 0
+		return data;
+	}
+
+	// Счетный хук: раз в interval инструкций сверяет счетчик и часы с пределами. После срабатывания
+	// хук вызывается на каждой инструкции, чтобы pcall внутри скрипта не мог перехватить прерывание
+	inline void watchdogHook(lua_State* L, lua_Debug*)
+	{
+		WatchdogData* data = watchdogData(L);
+		if (!data)
+			return;
+		if (!data->tripped)
+		{
+			data->executed += data->interval;
+			boost::uint64_t deadline = std::min(data->stateDeadline, data->callDeadline);
+			if (data->executed <= std::min(data->stateInstructions, data->callInstructions)
+				&& (deadline == std::numeric_limits<boost::uint64_t>::max() || monotonicNanos() <= deadline))
+				return;
+			data->tripped = true;
+			lua_sethook(L, & watchdogHook, LUA_MASKCOUNT, 1);
+		}
+		luaL_error(L, "script budget exceeded");
+	}
+
+	// Хуки в Lua у каждого потока свои, а сопрограмма наследует хук только при создании.
+	// Перед возобновлением co хук сторожа ставится на нее (или снимается) по состоянию сторожа контекста L.
+	// Уже стоящий хук с тем же интервалом не переустанавливается, чтобы не сбрасывать его счетчик
+	inline void syncWatchdogHook(lua_State* L, lua_State* co)
+	{
+		WatchdogData* data = watchdogData(L);
+		if (data && data->active)
+		{
+			const int count = data->tripped ? 1 : data->interval;
+			if (lua_gethook(co) != & watchdogHook || lua_gethookcount(co) != count)
+				lua_sethook(co, & watchdogHook, LUA_MASKCOUNT, count);
+		}
+		else if (lua_gethook(co) == & watchdogHook)
+			lua_sethook(co, 0, 0, 0);
+	}
+
+	// Если сторож сработал внутри сопрограммы, прерывание продолжается в возобновившем ее потоке:
+	// иначе скрипт получил бы false от coroutine.resume и продолжил работу
+	inline void raiseIfTripped(lua_State* L)
+	{
+		WatchdogData* data = watchdogData(L);
+		if (!data || !data->tripped)
+			return;
+		lua_sethook(L, & watchdogHook, LUA_MASKCOUNT, 1);
+		luaL_error(L, "script budget exceeded");
+	}
+
+	// coroutine.resume. Upvalue 1 - исходная функция
+	inline int watchdogResume(lua_State* L)
+	{
+		if (lua_State* co = lua_tothread(L, 1))
+			syncWatchdogHook(L, co);
+		lua_pushvalue(L, lua_upvalueindex(1)); // Lua Stack +1 resume
+		lua_insert(L, 1);
+		lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+		raiseIfTripped(L);
+		return lua_gettop(L);
+	}
+
+	// Функция, возвращаемая coroutine.wrap. Upvalue 1 - исходный coroutine.resume, 2 - поток.
+	// Ошибка сопрограммы передается дальше с местом вызова, как в исходном coroutine.wrap
+	inline int watchdogWrapped(lua_State* L)
+	{
+		syncWatchdogHook(L, lua_tothread(L, lua_upvalueindex(2)));
+		lua_pushvalue(L, lua_upvalueindex(2)); // Lua Stack +1 co
+		lua_insert(L, 1);
+		lua_pushvalue(L, lua_upvalueindex(1)); // Lua Stack +2 resume co
+		lua_insert(L, 1);
+		lua_call(L, lua_gettop(L) - 1, LUA_MULTRET); // Lua Stack ok results...|false err
+		raiseIfTripped(L);
+		if (lua_toboolean(L, 1))
+		{
+			lua_remove(L, 1);
+			return lua_gettop(L);
+		}
+		lua_settop(L, 2); // Lua Stack false err
+		if (lua_isstring(L, -1))
+		{
+			luaL_where(L, 1); // Lua Stack false err where
+			lua_insert(L, -2); // Lua Stack false where err
+			lua_concat(L, 2); // Lua Stack false msg
+		}
+		return lua_error(L);
+	}
+
+	// coroutine.wrap. Upvalue 1 - исходный coroutine.create, 2 - исходный coroutine.resume
+	inline int watchdogWrap(lua_State* L)
+	{
+		lua_pushvalue(L, lua_upvalueindex(1)); // Lua Stack +1 create
+		lua_insert(L, 1);
+		lua_call(L, lua_gettop(L) - 1, 1); // Lua Stack co
+		lua_pushvalue(L, lua_upvalueindex(2)); // Lua Stack co resume
+		lua_insert(L, -2); // Lua Stack resume co
+		lua_pushcclosure(L, & watchdogWrapped, 2); // Lua Stack func
+		return 1;
+	}
+
+	// Заменяет coroutine.resume и coroutine.wrap обертками, синхронизирующими хук сторожа.
+	// Повторная замена не делается, без библиотеки coroutine ничего не меняется
+	inline void wrapCoroutineLib(lua_State* L)
+	{
+		StackGuard guard(L);
+		lua_getglobal(L, "coroutine"); // Lua Stack +1 lib|nil
+		if (!lua_istable(L, -1))
+			return;
+		lua_getfield(L, -1, "resume"); // Lua Stack +2 lib resume
+		lua_getfield(L, -2, "create"); // Lua Stack +3 lib resume create
+		if (!lua_isfunction(L, -2) || !lua_isfunction(L, -1) || lua_tocfunction(L, -2) == & watchdogResume)
+			return;
+		lua_pushvalue(L, -2); // Lua Stack +4 lib resume create resume
+		lua_pushcclosure(L, & watchdogWrap, 2); // Lua Stack +3 lib resume wrap
+		lua_setfield(L, -3, "wrap"); // Lua Stack +2 lib resume
+		lua_pushcclosure(L, & watchdogResume, 1); // Lua Stack +2 lib wresume
+		lua_setfield(L, -2, "resume"); // Lua Stack +1 lib
+	}
+
+	// Ошибка lua_pcall, сообщение на вершине стека снимается. Если скрипт прервал сторож - LuaBudgetError
+	inline void throwCallError(lua_State* L)
+	{
+		std::string message = lua_isstring(L, -1) ? lua_tostring(L, -1) : "Unknown Lua error";
+		lua_pop(L, 1);
+		WatchdogData* data = watchdogData(L);
+		if (data && data->tripped)
+		{
+			data->tripped = false;
+			lua_sethook(L, & watchdogHook, LUA_MASKCOUNT, data->interval);
+			throw LuaBudgetError(message);
+		}
+		throw LuaRuntimeError(message);
+	}
+}
+
+#ifdef LUABINDER_PROFILE
+// Счетчики одной привязки. Время в наносекундах, включает преобразование аргументов и результатов
+struct LuaBindingStats
+{
+	std::string name;
+	boost::uint64_t calls;
+	boost::uint64_t totalNanos;
+	boost::uint64_t maxNanos;
+	boost::uint64_t convertErrors;
+	// Userdata, созданные конвертером привязки за время вызовов (результаты, копии, заимствованные указатели)
+	boost::uint64_t allocations;
+
+	LuaBindingStats() : calls(0), totalNanos(0), maxNanos(0), convertErrors(0), allocations(0) {}
+};
+
+namespace TypeManagerDetail
+{
+	// Счетчики контекста по именам привязок. Узлы std::map не перемещаются, замыкания хранят указатели на записи
+	typedef std::map<std::string, LuaBindingStats> ProfileData;
+
+	inline ProfileData* profileData(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LUABINDER_Profile"); // Lua Stack +1 data|nil
+		ProfileData* data = reinterpret_cast<ProfileData*> (lua_touserdata(L, -1));
+		lua_pop(L, 1); // Lua Stack 0
+		if (!data)
+		{
+			data = new (allocateLuaSpace<ProfileData > (L, "LUABINDER_ProfileData", false)) ProfileData; // Lua Stack +1 data
+			lua_setfield(L, LUA_REGISTRYINDEX, "LUABINDER_Profile"); // Lua Stack 0
+		}
+		return data;
+	}
+
+	// Lua Stack +1 record. Привязки с одним именем делят запись
+	inline void pushProfileRecord(lua_State* L, const std::string& name)
+	{
+		LuaBindingStats& stats = (*profileData(L))[name];
+		stats.name = name;
+		lua_pushlightuserdata(L, &stats);
+	}
+
+	// Замер одного вызова. Тривиально разрушаем, поэтому longjmp из lua_error может через него пройти
+	struct ProfileCall
+	{
+		LuaBindingStats* stats;
+		boost::uint64_t start;
+		std::size_t allocated;
+
+		ProfileCall(void* record, std::size_t userdata) :
+		stats(reinterpret_cast<LuaBindingStats*> (record)), start(monotonicNanos()), allocated(userdata) {}
+
+		inline int finish(std::size_t userdata, int results)
+		{
+			boost::uint64_t elapsed = monotonicNanos() - start;
+			++stats->calls;
+			stats->totalNanos += elapsed;
+			stats->maxNanos = std::max(stats->maxNanos, elapsed);
+			stats->allocations += userdata - allocated;
+			return results;
+		}
+
+		inline void convertError()
+		{
+			++stats->convertErrors;
+		}
+	};
+
+	// Lua: функция снимка счетчиков, возвращает таблицу имя -> {calls, time, maxTime, convertErrors, allocations}.
+	// Время в секундах
+	inline int profileSnapshot(lua_State* L)
+	{
+		const ProfileData* data = profileData(L);
+		lua_createtable(L, 0, static_cast<int> (data->size())); // Lua Stack +1 result
+		for (ProfileData::const_iterator it = data->begin(); it != data->end(); ++it)
+		{
+			lua_createtable(L, 0, 5); // Lua Stack +2 result stats
+			lua_pushnumber(L, static_cast<lua_Number> (it->second.calls));
+			lua_setfield(L, -2, "calls");
+			lua_pushnumber(L, static_cast<lua_Number> (it->second.totalNanos) / 1e9);
+			lua_setfield(L, -2, "time");
+			lua_pushnumber(L, static_cast<lua_Number> (it->second.maxNanos) / 1e9);
+			lua_setfield(L, -2, "maxTime");
+			lua_pushnumber(L, static_cast<lua_Number> (it->second.convertErrors));
+			lua_setfield(L, -2, "convertErrors");
+			lua_pushnumber(L, static_cast<lua_Number> (it->second.allocations));
+			lua_setfield(L, -2, "allocations");
+			lua_setfield(L, -2, it->first.c_str()); // Lua Stack +1 result
+		}
+		return 1;
+	}
+
+	inline bool hotterBinding(const LuaBindingStats& l, const LuaBindingStats& r)
+	{
+		return l.totalNanos > r.totalNanos;
+	}
+}
+#endif
+
+namespace TypeManagerDetail
+{
+
+	// Свойство типа: функции доступа выбираются при регистрации, __index вызывает их напрямую
+	struct PropertyHeader
+	{
+		int (*get)(lua_State*, const PropertyHeader*);
+		int (*set)(lua_State*, const PropertyHeader*);
+	};
+
+	// __index объектов типа со свойствами. Upvalue 1 - таблица свойств, upvalue 2 - метатаблица с методами.
+	// Обе таблицы производного типа наследуют (через __index) таблицы базового, поэтому поиск не raw
+	inline int propertyIndex(lua_State* L)
+	{
+		lua_pushvalue(L, 2); // Lua Stack +1 key
+		lua_gettable(L, lua_upvalueindex(1)); // Lua Stack +1 prop|nil
+		const PropertyHeader* prop = reinterpret_cast<const PropertyHeader*> (lua_touserdata(L, -1));
+		lua_pop(L, 1); // Lua Stack 0
+		if (prop)
+			return prop->get(L, prop);
+		lua_pushvalue(L, 2); // Lua Stack +1 key
+		lua_gettable(L, lua_upvalueindex(2)); // Lua Stack +1 method|nil
+		return 1;
+	}
+
+	// __newindex объектов типа со свойствами. Upvalue 1 - таблица свойств
+	inline int propertyNewIndex(lua_State* L)
+	{
+		lua_pushvalue(L, 2); // Lua Stack +1 key
+		lua_gettable(L, lua_upvalueindex(1)); // Lua Stack +1 prop|nil
+		const PropertyHeader* prop = reinterpret_cast<const PropertyHeader*> (lua_touserdata(L, -1));
+		lua_pop(L, 1); // Lua Stack 0
+		if (prop && prop->set)
+			return prop->set(L, prop);
+		return luaL_error(L, "cannot set field '%s'", lua_isstring(L, 2) ? lua_tostring(L, 2) : luaL_typename(L, 2));
+	}
+
+	// Промахи поиска в таблице target продолжаются в таблице fallback
+	inline void setIndexFallback(lua_State* L, int target, int fallback)
+	{
+		lua_pushvalue(L, target); // Lua Stack +1 target
+		lua_createtable(L, 0, 1); // Lua Stack +2 target mt
+		lua_pushvalue(L, fallback < 0 ? fallback - 2 : fallback); // Lua Stack +3 target mt fallback
+		lua_setfield(L, -2, "__index"); // Lua Stack +2 target mt
+		lua_setmetatable(L, -2); // Lua Stack +1 target
+		lua_pop(L, 1); // Lua Stack 0
+	}
+
+	// Метаметоды, которые наследник получает копией: Lua ищет их в метатаблице без __index.
+	// __index и __newindex заняты поиском методов и свойств, __gc у каждого типа свой
+	inline bool isInheritedMeta(lua_State* L, int key)
+	{
+		if (lua_type(L, key) != LUA_TSTRING)
+			return false;
+		const char* name = lua_tostring(L, key);
+		return name[0] == '_' && name[1] == '_' &&
+			std::strcmp(name, "__index") != 0 && std::strcmp(name, "__newindex") != 0 && std::strcmp(name, "__gc") != 0;
+	}
+
+	// Копирует наследуемые метаметоды из метатаблицы source в target, собственные метаметоды target остаются
+	inline void copyMetamethods(lua_State* L, int source, int target)
+	{
+		if (source < 0 && source > LUA_REGISTRYINDEX)
+			source = lua_gettop(L) + source + 1;
+		if (target < 0 && target > LUA_REGISTRYINDEX)
+			target = lua_gettop(L) + target + 1;
+		lua_pushnil(L); // Lua Stack +1 nil
+		while (lua_next(L, source)) // Lua Stack +2 key value
+		{
+			lua_pushvalue(L, -2); // Lua Stack +3 key value key
+			lua_rawget(L, target); // Lua Stack +3 key value own
+			if (isInheritedMeta(L, -3) && lua_isnil(L, -1))
 			{
-				// The table is not created yet
-				lua_pushstring(state, "LUABINDER_Alloc"); // Lua Stack +3 udata nil "LUABINDER.."
-				lua_newtable(state); // Lua Stack +4 udata nil "LUABINDER.." table
-				lua_rawset(state, LUA_REGISTRYINDEX); // Lua Stack +2 udata nil
-				lua_pop(state, 1); // Lua Stack +1 udata
-				lua_getfield(state, LUA_REGISTRYINDEX, "LUABINDER_Alloc"); // Lua Stack +2 udata table
+				lua_pop(L, 1); // Lua Stack +2 key value
+				lua_pushvalue(L, -2); // Lua Stack +3 key value key
+				lua_insert(L, -2); // Lua Stack +3 key key value
+				lua_rawset(L, target); // Lua Stack +1 key
 			}
-			lua_pushvalue(state, -2); // Lua Stack +3 udata table udata
-			lua_rawseti(state, -2, curindex); // Lua Stack +2 udata table
-			lua_pop(state, 2); // Lua Stack 0
-			curindex++;
+			else
+				lua_pop(L, 2); // Lua Stack +1 key
 		}
-		// Lua Stack +1 udata
-		return result;
+	}
+
+	// Ставит propertyIndex и propertyNewIndex в метатаблицу target
+	inline void setPropertyHandlers(lua_State* L, int props, int methods, int target)
+	{
+		lua_pushvalue(L, props); // Lua Stack +1 props
+		lua_pushvalue(L, methods); // Lua Stack +2 props meta
+		lua_pushcclosure(L, & propertyIndex, 2); // Lua Stack +1 closure
+		lua_setfield(L, target, "__index"); // Lua Stack 0
+		lua_pushvalue(L, props); // Lua Stack +1 props
+		lua_pushcclosure(L, & propertyNewIndex, 1); // Lua Stack +1 closure
+		lua_setfield(L, target, "__newindex"); // Lua Stack 0
 	}
 
 	template<class T> const std::type_info& templatedTypeid()
@@ -202,12 +713,29 @@ namespace TypeManagerDetail
 	{
 		struct MetaData
 		{
+			// Порядковый номер типа в реестре, назначается в registerType и совпадает
+			// с индексом типа в списке типов менеджера. Имя используется только в сообщениях об ошибках
+			unsigned int id;
+			// Ссылка на метатаблицу типа в реестре Lua (luaL_ref), создается один раз в registerType
+			int metaRef;
+			// Метатаблица без __gc для BorrowedPointerPolicy, __index указывает на основную
+			int borrowedMetaRef;
+			// Ссылка на слабую таблицу указатель -> userdata для CachedPointerPolicy
+			int cacheRef;
+			// Таблица свойств (regProperty), LUA_NOREF пока у типа нет свойств
+			int propsRef;
 			std::string name;
 			const std::type_info& (*staticInfoGetter) ();
+			// Смещения указателя при приведении к базовым типам, по номеру базового типа
+			// (noCast - не база). Заполняется в registerType<T, Base>, включая базы Base
+			std::vector<std::ptrdiff_t> upcast;
+
+			MetaData() : id(0), metaRef(LUA_NOREF), borrowedMetaRef(LUA_NOREF), cacheRef(LUA_NOREF), propsRef(LUA_NOREF),
+				staticInfoGetter(0) {}
 
 			bool operator ==(const MetaData & r)const
 			{
-				return name == r.name;
+				return id == r.id;
 			}
 			bool operator !=(const MetaData & r) const
 			{
@@ -215,195 +743,615 @@ namespace TypeManagerDetail
 			}
 		};
 
-		template <class T>
-		struct DataHolder
+		// Функции политики хранения. Один статический экземпляр на пару (тип, политика),
+		// в каждом userdata хранится только указатель на него. Адрес объекта возвращается
+		// без типа, чтобы его можно было привести к базовому классу по таблице upcast
+		struct HolderOps
 		{
-			const MetaData* meta;
-			bool isConst;
-			bool copyOnConstRem;
-			void* data;
-			T * (*getData)(void*);
-			const T * (*getConstData)(void*);
+			void* (*getData)(void*);
+			const void* (*getConstData)(void*);
 			void (*onGC)(void*);
+		};
+
+		template <class T, class RealSavePolicy>
+		struct HolderOpsOf
+		{
+			static void* getData(void* holder)
+			{
+				return RealSavePolicy::getHoldee(holder);
+			}
+			static const void* getConstData(void* holder)
+			{
+				return RealSavePolicy::getConstHoldee(holder);
+			}
+			static const HolderOps value;
+		};
 
+		// Общая часть всех userdata объектов. BorrowedPointerPolicy хранит только ее
+		struct HolderHeader
+		{
+			enum { isConst = 1, copyOnConstRem = 2, isBorrowed = 4 };
+
+			void* data;
+			unsigned int typeId;
+			unsigned char flags;
+		};
+
+		// Заголовок userdata с функциями политики, общий для всех типов
+		struct OpsHolder : HolderHeader
+		{
+			const HolderOps* ops;
+
+			inline void* getObject() const
+			{
+				return (flags & isBorrowed) ? data : ops->getData(data);
+			}
+			inline const void* getConstObject() const
+			{
+				return (flags & isBorrowed) ? data : ops->getConstData(data);
+			}
+		};
+
+		template <class T>
+		struct DataHolder : OpsHolder
+		{
 			~DataHolder() {
-				onGC(data);
+				ops->onGC(data);
+			}
+
+			inline T * getData() const
+			{
+				return static_cast<T*> (getObject());
+			}
+			inline const T * getConstData() const
+			{
+				return static_cast<const T*> (getConstObject());
+			}
+		};
+
+		// Userdata для InPlacePolicy: объект размещается сразу за DataHolder
+		template <class T>
+		struct ValueHolder
+		{
+			DataHolder<T> holder;
+			typename boost::aligned_storage<sizeof (T), boost::alignment_of<T>::value>::type storage;
+		};
+
+		// Способ размещения объекта в userdata в зависимости от политики хранения
+		enum { heldByPointer, heldInPlace, heldCached, heldBorrowed };
+		template <class RealSavePolicy> struct holderKind : mpl::int_<heldByPointer> {};
+		template <class T> struct holderKind<InPlacePolicy::apply<T> > : mpl::int_<heldInPlace> {};
+		template <class T> struct holderKind<CachedPointerPolicy::apply<T> > : mpl::int_<heldCached> {};
+		template <class T> struct holderKind<BorrowedPointerPolicy::apply<T> > : mpl::int_<heldBorrowed> {};
+		template <class RealSavePolicy> struct isInPlace : mpl::bool_<holderKind<RealSavePolicy>::value == heldInPlace> {};
+
+		// Выравнивание userdata в Lua 5.1 (LUAI_USER_ALIGNMENT_T по умолчанию)
+		union LuaUserAlign { double u; void* s; long l; };
+
+		// __gc MetaData: вместе с ней освобождаются ее ссылки в реестре (метатаблицы, кэш, свойства)
+		static int collectMetaData(lua_State* L)
+		{
+			MetaData* data = reinterpret_cast<MetaData*> (lua_touserdata(L, 1));
+			luaL_unref(L, LUA_REGISTRYINDEX, data->metaRef);
+			luaL_unref(L, LUA_REGISTRYINDEX, data->borrowedMetaRef);
+			luaL_unref(L, LUA_REGISTRYINDEX, data->cacheRef);
+			luaL_unref(L, LUA_REGISTRYINDEX, data->propsRef);
+			data->~MetaData();
+			return 0;
+		}
+
+		// Lua Stack 0. MetaData закрепляется в LUABINDER_Alloc, номер слота возвращается через anchor
+		static MetaData* newMetaData(lua_State* L, int& anchor)
+		{
+			void* space = lua_newuserdata(L, sizeof (MetaData)); // Lua Stack +1 udata
+			if (luaL_newmetatable(L, "LUABINDMetaData")) // Lua Stack +2 udata meta
+			{
+				lua_pushcfunction(L, & StackImplBase::collectMetaData); // Lua Stack +3 udata meta func
+				lua_setfield(L, -2, "__gc"); // Lua Stack +2 udata meta
+			}
+			MetaData* data = new (space) MetaData;
+			lua_setmetatable(L, -2); // Lua Stack +1 udata
+			anchor = anchorLuaSpace(L, -1);
+			lua_pop(L, 1); // Lua Stack 0
+			return data;
+		}
+
+		// Удаляет реестр MetaData вместе с последним менеджером цепочки и снимает закрепление MetaData,
+		// после чего их собирает сборщик мусора. Слоты LUABINDER_Alloc переиспользуются следующими регистрациями.
+		// Поэтому менеджеры (и движки, и функции Lua, которые их держат) разрушаются до lua_close
+		struct MetaDataRelease
+		{
+			std::vector<std::pair<lua_State*, int> > anchors;
+
+			void operator ()(std::vector<MetaData*>* data) const
+			{
+				for (std::size_t i = 0; i < anchors.size(); ++i)
+					releaseLuaSpace(anchors[i].first, anchors[i].second);
+				delete data;
 			}
 		};
 
 		// Указатели MetaData* указывают на область памяти, выделенной Lua.
-		// Эти области являются full userdata и удаляются вместе с закрытием контекста Lua
-		// по метасобытию __gc
+		// Эти области являются full userdata, закрепленными в LUABINDER_Alloc, пока жив реестр mdata
 		boost::shared_ptr<std::vector<MetaData*> > mdata;
+#ifdef LUABINDER_PROFILE
+		// Userdata, созданные этим конвертером. Профилировщик берет разницу за вызов
+		mutable std::size_t allocatedUserdata;
+
+		StackImplBase() : mdata(new std::vector<MetaData*>(), MetaDataRelease()), allocatedUserdata(0) {}
 
-		StackImplBase() : mdata(new std::vector<MetaData*>()) {}
+		StackImplBase(const boost::shared_ptr<std::vector<MetaData*> >& data) : mdata(data), allocatedUserdata(0) {}
+#else
+		StackImplBase() : mdata(new std::vector<MetaData*>(), MetaDataRelease()) {}
 
 		StackImplBase(const boost::shared_ptr<std::vector<MetaData*> >& data) : mdata(data) {}
+#endif
 
-		void _igetFromStack();
-		void _ipushToStack();
-	};
-	template <class TList, int _Idx> struct StackImpl;
+		// Lua Stack +1 props, см. LuaTypesManager::pushProperties
+		inline void _pushProperties(lua_State* L, unsigned int id) const
+		{
+			MetaData* data = (*mdata)[id];
+			if (data->propsRef != LUA_NOREF)
+			{
+				lua_rawgeti(L, LUA_REGISTRYINDEX, data->propsRef); // Lua Stack +1 props
+				return;
+			}
+			lua_newtable(L); // Lua Stack +1 props
+			int props = lua_gettop(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, data->metaRef); // Lua Stack +2 props meta
+			lua_rawgeti(L, LUA_REGISTRYINDEX, data->borrowedMetaRef); // Lua Stack +3 props meta bmeta
+			setPropertyHandlers(L, props, props + 1, props + 1);
+			setPropertyHandlers(L, props, props + 1, props + 2);
+			lua_pop(L, 2); // Lua Stack +1 props
+			lua_pushvalue(L, -1); // Lua Stack +2 props props
+			data->propsRef = luaL_ref(L, LUA_REGISTRYINDEX); // Lua Stack +1 props
+		}
 
-	template <int _Idx> struct StackImpl<mpl::vector<>, _Idx> : StackImplBase
-	{
-		StackImpl(const boost::shared_ptr<std::vector<StackImplBase::MetaData*> >& data) :StackImplBase(data) {}
+		static inline std::ptrdiff_t noCast()
+		{
+			return std::numeric_limits<std::ptrdiff_t>::min();
+		}
 
-		StackImpl() {}
-		void _igetFromStack(int);
-		void _ipushToStack(int);
+		// Заголовок объекта по индексу стека, 0 если это чужой userdata (LuaArrayView, userdata других библиотек).
+		// Номер типа из заголовка подтверждается метатаблицей userdata, только после этого заголовку можно верить
+		inline const OpsHolder* holderAt(lua_State* L, int ind) const
+		{
+			if (lua_type(L, ind) != LUA_TUSERDATA || lua_objlen(L, ind) < sizeof (HolderHeader))
+				return 0;
+			const OpsHolder* holder = reinterpret_cast<const OpsHolder*> (lua_touserdata(L, ind));
+			if (holder->typeId >= mdata->size() || !lua_getmetatable(L, ind)) // Lua Stack +1 meta
+				return 0;
+			const MetaData* data = (*mdata)[holder->typeId];
+			lua_rawgeti(L, LUA_REGISTRYINDEX, (holder->flags & HolderHeader::isBorrowed) ? data->borrowedMetaRef : data->metaRef); // Lua Stack +2 meta typemeta
+			const bool known = lua_rawequal(L, -2, -1) != 0;
+			lua_pop(L, 2); // Lua Stack 0
+			return known ? holder : 0;
+		}
+
+		// Адрес объекта userdata как типа с номером to: тот же тип или один из его базовых. 0 если нельзя.
+		// holder должен быть получен через holderAt
+		inline const void* castObject(const OpsHolder* holder, unsigned int to) const
+		{
+			const void* object = holder->getConstObject();
+			if (holder->typeId == to)
+				return object;
+			const std::vector<std::ptrdiff_t>& upcast = (*mdata)[holder->typeId]->upcast;
+			if (to >= upcast.size() || upcast[to] == noCast())
+				return 0;
+			return static_cast<const char*> (object) + upcast[to];
+		}
+	};
+	template <class T, class RealSavePolicy>
+	const StackImplBase::HolderOps StackImplBase::HolderOpsOf<T, RealSavePolicy>::value =
+	{
+		& StackImplBase::HolderOpsOf<T, RealSavePolicy>::getData,
+		& StackImplBase::HolderOpsOf<T, RealSavePolicy>::getConstData,
+		& RealSavePolicy::onMetaGc
 	};
 
-	template <class TList, int _Idx> struct genInherit
+	// Смещение указателя при приведении Derived* к Base*. При невиртуальном наследовании
+	// static_cast не обращается к объекту, поэтому достаточно адреса-заглушки
+	template <class Derived, class Base>
+	inline std::ptrdiff_t baseOffset()
 	{
-	private:
-		typedef typename mpl::pop_front<TList>::type tOne;
-	public:
-		typedef typename mpl::if_<
-			typename mpl::equal<tOne, mpl::vector<> >::type,
-			StackImplBase,
-			StackImpl<tOne, _Idx + 1 > >::type type;
+		Derived* probe = reinterpret_cast<Derived*> (static_cast<std::size_t> (0x1000));
+		return reinterpret_cast<char*> (static_cast<Base*> (probe)) - reinterpret_cast<char*> (probe);
+	}
+
+	// Плоский реестр типов: отображение тип -> порядковый номер строится одним проходом по списку,
+	// дальнейшие проверки и поиск индекса не зависят от числа зарегистрированных типов
+	template <class TList>
+	struct TypeRegistry
+	{
+		typedef typename mpl::fold<TList, mpl::map0<>,
+			mpl::insert<mpl::_1, mpl::pair<mpl::_2, mpl::size<mpl::_1> > > >::type indexMap;
+
+		template <class T> struct contains : mpl::has_key<indexMap, T> {};
+		template <class T> struct index : mpl::at<indexMap, T>::type {};
 	};
 
-	template <class TList, int _Idx> struct StackImpl : genInherit<TList, _Idx>::type
+	// Операции над зарегистрированными типами. Все функции - шаблоны по типу объекта,
+	// доступные только для типов из TList: один класс вместо цепочки наследования по типу на уровень
+	template <class TList>
+	struct StackImpl : StackImplBase
 	{
-	private:
-		typedef typename mpl::front<TList>::type CurrType;
-	public:
-		StackImpl(const boost::shared_ptr<std::vector<StackImplBase::MetaData*> >& data)
-			:genInherit<TList, _Idx>::type(data) {}
+		typedef TypeRegistry<TList> registry;
+
+		StackImpl(const boost::shared_ptr<std::vector<StackImplBase::MetaData*> >& data) : StackImplBase(data) {}
 
 		StackImpl() {}
 
-		inline CurrType * _igetFromStack(lua_State* L, int ind, Type2Type<CurrType*>) const
+		template <class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type, CurrType*>::type
+			_igetFromStack(lua_State* L, int ind, Type2Type<CurrType*>) const
 		{
-			if (lua_isuserdata(L, ind))
+			const unsigned int _Idx = registry::template index<CurrType>::value;
+			if (const StackImplBase::OpsHolder* myDataHolder = this->holderAt(L, ind))
 			{
-				StackImplBase::DataHolder<CurrType>* myDataHolder = reinterpret_cast<StackImplBase::DataHolder<CurrType>*> (lua_touserdata(L, ind));
-				if ((*myDataHolder->meta) != (*this->StackImplBase::mdata->at(_Idx)))
+				const void* object = this->castObject(myDataHolder, _Idx);
+				if (!object)
 					throw LuaConvertError(ind, this->StackImplBase::mdata->at(_Idx)->name);
-				if (myDataHolder->isConst)
+				if (myDataHolder->flags & StackImplBase::HolderHeader::isConst)
 				{
-					if (myDataHolder->copyOnConstRem)
+					if (myDataHolder->flags & StackImplBase::HolderHeader::copyOnConstRem)
 					{
-						//const CurrType* obj = myDataHolder->getConstData(myDataHolder->data);
+						//const CurrType* obj = myDataHolder->getConstData();
 						//CurrType *itsCopy = new (allocateLuaSpace<CurrType > (L, "temporary")) CurrType(*obj);
 						//return itsCopy;
 					} else
 						throw LuaConvertError(ind, this->StackImplBase::mdata->at(_Idx)->name);
 				}
-				return myDataHolder->getData(myDataHolder->data);
+				return static_cast<CurrType*> (const_cast<void*> (object));
 			}
 			throw LuaConvertError(ind, this->StackImplBase::mdata->at(_Idx)->name);
 		}
 
-		inline const CurrType * _igetFromStack(lua_State* L, int ind, Type2Type<const CurrType*>) const
+		template <class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type, const CurrType*>::type
+			_igetFromStack(lua_State* L, int ind, Type2Type<const CurrType*>) const
 		{
-			if (lua_isuserdata(L, ind))
+			const unsigned int _Idx = registry::template index<CurrType>::value;
+			if (const StackImplBase::OpsHolder* myDataHolder = this->holderAt(L, ind))
 			{
-				StackImplBase::DataHolder<CurrType>* myDataHolder = reinterpret_cast<StackImplBase::DataHolder<CurrType>*> (lua_touserdata(L, ind));
-				if ((*myDataHolder->meta) != (*this->StackImplBase::mdata->at(_Idx)))
-					throw LuaConvertError(ind, std::string("const ") + this->StackImplBase::mdata->at(_Idx)->name);
-				return myDataHolder->getConstData(myDataHolder->data);
+				if (const void* object = this->castObject(myDataHolder, _Idx))
+					return static_cast<const CurrType*> (object);
 			}
 			throw LuaConvertError(ind, std::string("const ") + this->StackImplBase::mdata->at(_Idx)->name);
 		}
 
-		template <class SavePolicy>
-		inline void _ipushToStack(lua_State* L, CurrType* topush, Type2Type<CurrType*>) const
+		template <class SavePolicy, class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_ipushToStack(lua_State* L, CurrType* topush, Type2Type<CurrType*>) const
 		{
 			typedef typename mpl::if_<boost::is_same<SavePolicy, StdPointerPolicy>,
 				SimplePointerPolicy::apply<CurrType>,
 				typename SavePolicy::template apply<CurrType> >::type realSavePolicy;
-			StackImplBase::MetaData* myMeta = this->StackImplBase::mdata->at(_Idx);
-			StackImplBase::DataHolder<CurrType>* myDataHolder =
-				new(allocateLuaSpace<StackImplBase::DataHolder<CurrType> >(L, myMeta->name.c_str(), false)) StackImplBase::DataHolder<CurrType>;
-			myDataHolder->meta = myMeta;
-			myDataHolder->data = realSavePolicy::getTypeHolder(topush);
-			myDataHolder->isConst = false;
-			myDataHolder->copyOnConstRem = false;
-			myDataHolder->getConstData = &realSavePolicy::getConstHoldee;
-			myDataHolder->getData = &realSavePolicy::getHoldee;
-			myDataHolder->onGC = &realSavePolicy::onMetaGc;
+			_pushPointer<realSavePolicy>(L, topush, 0, typename StackImplBase::holderKind<realSavePolicy>::type());
 		}
 
-		template <class SavePolicy>
-		inline void _ipushToStack(lua_State* L, const CurrType& topush, Type2Type<const CurrType>) const
+		template <class SavePolicy, class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_ipushToStack(lua_State* L, const CurrType& topush, Type2Type<const CurrType>) const
 		{
-			typedef typename mpl::if_<boost::is_same<SavePolicy, StdPointerPolicy>,
-				GcPointerPolicy::apply<CurrType>,
-				typename SavePolicy::template apply<CurrType> >::type realSavePolicy;
-			StackImplBase::MetaData *myMeta = this->StackImplBase::mdata->at(_Idx);
-			StackImplBase::DataHolder<CurrType>* myDataHolder =
-				new(allocateLuaSpace<StackImplBase::DataHolder<CurrType> >(L, myMeta->name.c_str(), false)) StackImplBase::DataHolder<CurrType>;
-			myDataHolder->meta = myMeta;
-			myDataHolder->data = realSavePolicy::getTypeHolder(new CurrType(topush));
-			myDataHolder->isConst = false;
-			myDataHolder->copyOnConstRem = false;
-			myDataHolder->getConstData = &realSavePolicy::getConstHoldee;
-			myDataHolder->getData = &realSavePolicy::getHoldee;
-			myDataHolder->onGC = &realSavePolicy::onMetaGc;
+			typedef typename valuePolicy<SavePolicy, CurrType>::type realSavePolicy;
+			_pushCopy<realSavePolicy>(L, topush, typename StackImplBase::isInPlace<realSavePolicy>::type());
+		}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+		// CurrType выводится и из Type2Type, поэтому перегрузка принимает только rvalue
+		template <class SavePolicy, class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_ipushToStack(lua_State* L, CurrType&& topush, Type2Type<CurrType>) const
+		{
+			typedef typename valuePolicy<SavePolicy, CurrType>::type realSavePolicy;
+			_pushCopy<realSavePolicy>(L, static_cast<CurrType&&> (topush), typename StackImplBase::isInPlace<realSavePolicy>::type());
 		}
+#endif
 
-		template <class SavePolicy>
-		inline void _ipushToStack(lua_State* L, const CurrType* topush, Type2Type<const CurrType*>) const
+		template <class SavePolicy, class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_ipushToStack(lua_State* L, const CurrType* topush, Type2Type<const CurrType*>) const
 		{
 			typedef typename mpl::if_<boost::is_same<SavePolicy, StdPointerPolicy>,
 				GcPointerPolicy::apply<CurrType>,
 				typename SavePolicy::template apply<CurrType> >::type realSavePolicy;
-			StackImplBase::MetaData *myMeta = this->StackImplBase::mdata->at(_Idx);
-			StackImplBase::DataHolder<CurrType>* myDataHolder =
-				new(allocateLuaSpace<StackImplBase::DataHolder<CurrType> >(L, myMeta->name.c_str(), false)) StackImplBase::DataHolder<CurrType>;
-			myDataHolder->meta = myMeta;
-			myDataHolder->data = realSavePolicy::getTypeHolder(topush);
-			myDataHolder->isConst = true;
-			myDataHolder->copyOnConstRem = false;
-			myDataHolder->getConstData = &realSavePolicy::getConstHoldee;
-			myDataHolder->getData = &realSavePolicy::getHoldee;
-			myDataHolder->onGC = &realSavePolicy::onMetaGc;
-		}
-		using genInherit<TList, _Idx>::type::_igetFromStack;
-		using genInherit<TList, _Idx>::type::_ipushToStack;
-	};
-
-#	define CREATOR_FUNC_ARITY 8
-#	define CREATOR_FUNC_PARAM_ITEM(z, n, unused) typename boost::fusion::result_of::at_c<FusedArgs, n>::type Arg##n
-#	define CREATOR_FUNC_ITEM(z, n, unused) template <class T, class FusedArgs> \
-	T* creatorFunc(BOOST_PP_ENUM(n, CREATOR_FUNC_PARAM_ITEM, unused) BOOST_PP_COMMA_IF(n) void* place) \
-	{ \
-		return new(place) T(BOOST_PP_ENUM_PARAMS(n, Arg)); \
-	};
-
-	BOOST_PP_REPEAT(CREATOR_FUNC_ARITY, CREATOR_FUNC_ITEM, ~)
-#	undef CREATOR_FUNC_ITEM
-#	undef CREATOR_FUNC_PARAM_ITEM
-#	undef CREATOR_FUNC_ARITY
+			_pushPointer<realSavePolicy>(L, topush, StackImplBase::HolderHeader::isConst, typename StackImplBase::holderKind<realSavePolicy>::type());
+		}
 
-	/*template <class T, class FusedArgs>
-	T* genericCreator(const FusedArgs& arg, void* place)
-	{
-		typedef typename boost::fusion::result_of::push_back<FusedArgs, void*>::type realArgsType;
-		typedef typename boost::fusion::result_of::push_front<realArgsType, T*>::type funcArgsType;
-		typedef typename boost::function_types::function_pointer<funcArgsType>::type funcType;
+		template <class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_iforgetObject(lua_State* L, const CurrType* obj) const
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, (*this->StackImplBase::mdata)[registry::template index<CurrType>::value]->cacheRef); // Lua Stack +1 cache
+			lua_pushlightuserdata(L, const_cast<CurrType*> (obj)); // Lua Stack +2 cache key
+			lua_pushnil(L); // Lua Stack +3 cache key nil
+			lua_rawset(L, -3); // Lua Stack +1 cache
+			lua_pop(L, 1); // Lua Stack 0
+		}
 
-		return boost::fusion::invoke((funcType) & creatorFunc, boost::fusion::push_back(arg, place));
-	}*/
-}
+		// Конструирование объекта прямо в userdata. _iallocInPlace оставляет на стеке userdata без метатаблицы,
+		// _icommitInPlace ставит метатаблицу после успешного конструирования: если конструктор бросит
+		// исключение, __gc не будет вызван для неинициализированного объекта
+		template <class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type, void*>::type
+			_iallocInPlace(lua_State* L, Type2Type<CurrType>) const
+		{
+			BOOST_STATIC_ASSERT(boost::alignment_of<CurrType>::value <= boost::alignment_of<StackImplBase::LuaUserAlign>::value);
+			LUABINDER_PROFILE_ALLOC();
+			StackImplBase::ValueHolder<CurrType>* myValueHolder =
+				reinterpret_cast<StackImplBase::ValueHolder<CurrType>*> (lua_newuserdata(L, sizeof (StackImplBase::ValueHolder<CurrType>))); // Lua Stack +1 udata
+			return myValueHolder->storage.address();
+		}
+		template <class CurrType>
+		inline typename boost::enable_if<typename registry::template contains<CurrType>::type>::type
+			_icommitInPlace(lua_State* L, Type2Type<CurrType>) const
+		{
+			StackImplBase::ValueHolder<CurrType>* myValueHolder =
+				reinterpret_cast<StackImplBase::ValueHolder<CurrType>*> (lua_touserdata(L, -1));
+			_setupHolder<InPlacePolicy::apply<CurrType> >(L, new (&myValueHolder->holder) StackImplBase::DataHolder<CurrType>, myValueHolder->storage.address(), 0);
+		}
 
-// Тип возврата функций getFromStack
-// Скаляры возвращаются собой, объекты через указатели
+	private:
+		// Значения по умолчанию хранятся прямо в userdata, если позволяет выравнивание
+		template <class SavePolicy, class CurrType> struct valuePolicy :
+			mpl::if_<boost::is_same<SavePolicy, StdPointerPolicy>,
+				typename mpl::if_c<(boost::alignment_of<CurrType>::value <= boost::alignment_of<StackImplBase::LuaUserAlign>::value),
+					InPlacePolicy::apply<CurrType>,
+					GcPointerPolicy::apply<CurrType> >::type,
+				typename SavePolicy::template apply<CurrType> > {};
 
-template <class T> struct getTraits :
-mpl::eval_if<boost::is_scalar<T>,
-mpl::identity<T>,
-mpl::if_<boost::is_same<std::string, typename boost::remove_pointer<typename remove_cv_ref<T>::type>::type>,
-T,
-boost::reference_wrapper<T>
->
-> {};
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushPointer(lua_State* L, CurrType* topush, unsigned char flags, mpl::int_<StackImplBase::heldByPointer>) const
+		{
+			_newHolder<RealSavePolicy, typename boost::remove_cv<CurrType>::type>(L, RealSavePolicy::getTypeHolder(topush), flags);
+		}
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushPointer(lua_State* L, CurrType* topush, unsigned char, mpl::int_<StackImplBase::heldInPlace>) const
+		{
+			_pushCopy<RealSavePolicy>(L, *topush, mpl::true_());
+		}
+		// Lua Stack +1 udata
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushPointer(lua_State* L, CurrType* topush, unsigned char flags, mpl::int_<StackImplBase::heldBorrowed>) const
+		{
+			const unsigned int _Idx = registry::template index<typename boost::remove_cv<CurrType>::type>::value;
+			LUABINDER_PROFILE_ALLOC();
+			StackImplBase::HolderHeader* myHeader =
+				reinterpret_cast<StackImplBase::HolderHeader*> (lua_newuserdata(L, sizeof (StackImplBase::HolderHeader))); // Lua Stack +1 udata
+			myHeader->data = RealSavePolicy::getTypeHolder(topush);
+			myHeader->typeId = _Idx;
+			myHeader->flags = flags | StackImplBase::HolderHeader::isBorrowed;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, (*this->StackImplBase::mdata)[_Idx]->borrowedMetaRef); // Lua Stack +2 udata meta
+			lua_setmetatable(L, -2); // Lua Stack +1 udata
+		}
+		// Lua Stack +1 udata
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushPointer(lua_State* L, CurrType* topush, unsigned char flags, mpl::int_<StackImplBase::heldCached>) const
+		{
+			typedef typename boost::remove_cv<CurrType>::type clearType;
+			void* key = RealSavePolicy::getTypeHolder(topush);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, (*this->StackImplBase::mdata)[registry::template index<clearType>::value]->cacheRef); // Lua Stack +1 cache
+			lua_pushlightuserdata(L, key); // Lua Stack +2 cache key
+			lua_rawget(L, -2); // Lua Stack +2 cache udata|nil
+			if (lua_isuserdata(L, -1))
+			{
+				// Константный и неконстантный доступ к одному объекту кэшируются по последней передаче
+				const StackImplBase::HolderHeader* myHeader =
+					reinterpret_cast<const StackImplBase::HolderHeader*> (lua_touserdata(L, -1));
+				if (myHeader->flags == flags)
+				{
+					lua_remove(L, -2); // Lua Stack +1 udata
+					return;
+				}
+			}
+			lua_pop(L, 1); // Lua Stack +1 cache
+			_newHolder<RealSavePolicy, clearType>(L, key, flags); // Lua Stack +2 cache udata
+			lua_pushlightuserdata(L, key); // Lua Stack +3 cache udata key
+			lua_pushvalue(L, -2); // Lua Stack +4 cache udata key udata
+			lua_rawset(L, -4); // Lua Stack +2 cache udata
+			lua_remove(L, -2); // Lua Stack +1 udata
+		}
+
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushCopy(lua_State* L, const CurrType& topush, mpl::false_) const
+		{
+			_newHolder<RealSavePolicy, CurrType>(L, RealSavePolicy::getTypeHolder(new CurrType(topush)), 0);
+		}
+		// Lua Stack +1 udata
+		template <class RealSavePolicy, class CurrType>
+		inline void _pushCopy(lua_State* L, const CurrType& topush, mpl::true_) const
+		{
+			new (_iallocInPlace(L, Type2Type<CurrType>())) CurrType(topush);
+			_icommitInPlace(L, Type2Type<CurrType>());
+		}
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+		template <class RealSavePolicy, class CurrType>
+		inline typename boost::disable_if<boost::is_reference<CurrType> >::type
+			_pushCopy(lua_State* L, CurrType&& topush, mpl::false_) const
+		{
+			_newHolder<RealSavePolicy, CurrType>(L, RealSavePolicy::getTypeHolder(new CurrType(static_cast<CurrType&&> (topush))), 0);
+		}
+		template <class RealSavePolicy, class CurrType>
+		inline typename boost::disable_if<boost::is_reference<CurrType> >::type
+			_pushCopy(lua_State* L, CurrType&& topush, mpl::true_) const
+		{
+			new (_iallocInPlace(L, Type2Type<CurrType>())) CurrType(static_cast<CurrType&&> (topush));
+			_icommitInPlace(L, Type2Type<CurrType>());
+		}
+#endif
+
+		// Lua Stack +1 udata
+		template <class RealSavePolicy, class CurrType>
+		inline void _newHolder(lua_State* L, void* data, unsigned char flags) const
+		{
+			LUABINDER_PROFILE_ALLOC();
+			_setupHolder<RealSavePolicy>(L,
+				new(lua_newuserdata(L, sizeof (StackImplBase::DataHolder<CurrType>))) StackImplBase::DataHolder<CurrType>, // Lua Stack +1 udata
+				data, flags);
+		}
+
+		// Userdata должен быть на вершине стека
+		template <class RealSavePolicy, class CurrType>
+		inline void _setupHolder(lua_State* L, StackImplBase::DataHolder<CurrType>* myDataHolder, void* data, unsigned char flags) const
+		{
+			const unsigned int _Idx = registry::template index<CurrType>::value;
+			myDataHolder->ops = & StackImplBase::HolderOpsOf<CurrType, RealSavePolicy>::value;
+			myDataHolder->data = data;
+			myDataHolder->typeId = _Idx;
+			myDataHolder->flags = flags;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, (*this->StackImplBase::mdata)[_Idx]->metaRef); // Lua Stack +2 udata meta
+			lua_setmetatable(L, -2); // Lua Stack +1 udata
+		}
+	};
+
+}
+
+// Строка Lua без копирования: указатель и длина, полученные через lua_tolstring.
+// Действительна, пока строка находится на стеке Lua, то есть на время вызова функции.
+// Может содержать нулевые символы
+class LuaStringRef
+{
+public:
+	LuaStringRef() : m_data(""), m_size(0) {}
+	LuaStringRef(const char* data, std::size_t size) : m_data(data), m_size(size) {}
+	LuaStringRef(const std::string& str) : m_data(str.data()), m_size(str.size()) {}
+
+	inline const char* data() const
+	{
+		return m_data;
+	}
+	inline std::size_t size() const
+	{
+		return m_size;
+	}
+	inline bool empty() const
+	{
+		return m_size == 0;
+	}
+	inline char operator[] (std::size_t i) const
+	{
+		return m_data[i];
+	}
+	inline std::string str() const
+	{
+		return std::string(m_data, m_size);
+	}
+
+private:
+	const char* m_data;
+	std::size_t m_size;
+};
+
+// Представление непрерывного буфера C++ в Lua без копирования: a[i], a[i] = v, #a,
+// а также a:fill(v), a:copy(src [, dstStart, srcStart, count]) и a:map(func), выполняемые в C++.
+// Тип элементов регистрируется через LuaEngine::regArray<T>().
+// Представление std::vector читает адрес и размер при каждом обращении, поэтому переживает его изменение размера
+template <class T>
+class LuaArrayView
+{
+public:
+	typedef T value_type;
+
+	LuaArrayView(T* data, std::size_t size) : m_vec(0), m_data(data), m_size(size) {}
+	explicit LuaArrayView(std::vector<T>& vec) : m_vec(&vec), m_data(0), m_size(0) {}
+
+	inline std::size_t size() const
+	{
+		return m_vec ? m_vec->size() : m_size;
+	}
+	inline T* data() const
+	{
+		return m_vec ? (m_vec->empty() ? 0 : &(*m_vec)[0]) : m_data;
+	}
+	inline T& operator[] (std::size_t i) const
+	{
+		return data()[i];
+	}
+
+private:
+	std::vector<T>* m_vec;
+	T* m_data;
+	std::size_t m_size;
+};
+
+namespace TypeManagerDetail
+{
+	template <class T>
+	struct ArrayViewHolder
+	{
+		const std::type_info& (*tag) ();
+		LuaArrayView<T> view;
+
+		ArrayViewHolder(const LuaArrayView<T>& v) : tag(& templatedTypeid<LuaArrayView<T> >), view(v) {}
+	};
+
+	template <class T>
+	inline const char* arrayViewName()
+	{
+		return typeid (LuaArrayView<T>).name();
+	}
+
+	// Хранилище для аргумента-указателя на незарегистрированный тип (int*, double*, std::string*).
+	// Живет до конца выражения с вызовом функции, поэтому userdata для него не нужна
+	template <class T>
+	class ValueArg
+	{
+	public:
+		ValueArg() : m_value() {}
+		explicit ValueArg(const T& value) : m_value(value) {}
+
+		inline operator T* () const
+		{
+			return &m_value;
+		}
+		inline T& get() const
+		{
+			return m_value;
+		}
+
+	private:
+		mutable T m_value;
+	};
+
+	// lua_Number -> целое или перечисление. Отрицательные значения идут через знаковый тип,
+	// положительные через беззнаковый, чтобы не терять диапазон uint64_t (точность - до 2^53)
+	template <class T>
+	inline T fromLuaNumber(lua_Number n)
+	{
+		return n < 0 ? static_cast<T> (static_cast<boost::intmax_t> (n)) : static_cast<T> (static_cast<boost::uintmax_t> (n));
+	}
+
+	template <class T>
+	inline lua_Number toLuaNumber(T value)
+	{
+		typedef typename mpl::if_<boost::is_enum<T>, boost::intmax_t, T>::type numericType;
+		return static_cast<lua_Number> (static_cast<numericType> (value));
+	}
+}
+
+// Тип возврата функций getFromStack
+// Скаляры возвращаются собой, объекты через указатели
+
+template <class T> struct getTraits :
+mpl::eval_if<boost::is_scalar<T>,
+mpl::identity<T>,
+mpl::if_<boost::is_same<std::string, typename boost::remove_pointer<typename remove_cv_ref<T>::type>::type>,
+T,
+boost::reference_wrapper<T>
+>
+> {};
+
+template <class T> struct getTraits<LuaArrayView<T> > : mpl::identity<LuaArrayView<T> > {};
+template <> struct getTraits<LuaStringRef> : mpl::identity<LuaStringRef> {};
+template <> struct getTraits<const LuaStringRef> : mpl::identity<LuaStringRef> {};
+// Контейнеры STL преобразуются в таблицы Lua и обратно, поэтому передаются по значению
+template <class T, class A> struct getTraits<std::vector<T, A> > : mpl::identity<std::vector<T, A> > {};
+template <class T, class A> struct getTraits<const std::vector<T, A> > : mpl::identity<std::vector<T, A> > {};
+template <class K, class V, class C, class A> struct getTraits<std::map<K, V, C, A> > : mpl::identity<std::map<K, V, C, A> > {};
+template <class K, class V, class C, class A> struct getTraits<const std::map<K, V, C, A> > : mpl::identity<std::map<K, V, C, A> > {};
 
 template <class TypesList>
-class LuaTypesManager : protected TypeManagerDetail::StackImpl<TypesList, 0 >, public boost::noncopyable
+class LuaTypesManager : protected TypeManagerDetail::StackImpl<TypesList>, public boost::noncopyable
 {
 public:
 	template < class T > struct AddedType
@@ -411,19 +1359,41 @@ public:
 		typedef LuaTypesManager<typename mpl::push_back<TypesList, T>::type> type;
 	};
 
-	template <class T, int Dummy = 0> struct isRegistred : mpl::contains<TypesList, T> {};
+	// Зарегистрирован ли тип объектов T (поиск по плоскому реестру)
+	template <class T> struct hasType : TypeManagerDetail::TypeRegistry<TypesList>::template contains<T> {};
+
+	// Целые типы и перечисления преобразуются в числа Lua общим конвертером, вещественные - только
+	// float и double (у long double конвертера нет, такой результат отбрасывается)
+	template <class T, int Dummy = 0> struct isRegistred :
+	mpl::or_<hasType<T>, boost::is_integral<T>, boost::is_enum<T> > {};
 	template <int Dummy> struct isRegistred<int, Dummy> : mpl::true_ {};
+	template <int Dummy> struct isRegistred<double, Dummy> : mpl::true_ {};
 	template <int Dummy> struct isRegistred<std::string, Dummy> : mpl::true_ {};
 	template <int Dummy> struct isRegistred<const char*, Dummy> : mpl::true_ {};
 	template <int Dummy> struct isRegistred<float, Dummy> : mpl::true_ {};
+	template <int Dummy> struct isRegistred<LuaStringRef, Dummy> : mpl::true_ {};
+	template <class T, int Dummy> struct isRegistred<LuaArrayView<T>, Dummy> : mpl::true_ {};
+	template <class T, class A, int Dummy> struct isRegistred<std::vector<T, A>, Dummy> : mpl::true_ {};
+	template <class K, class V, class C, class A, int Dummy> struct isRegistred<std::map<K, V, C, A>, Dummy> : mpl::true_ {};
+
+	// Результаты функций, раскладываемые в несколько значений Lua
+	template <class T, int Dummy = 0> struct isMultiResult : mpl::false_ {};
+	template <class T1, class T2, int Dummy> struct isMultiResult<std::pair<T1, T2>, Dummy> : mpl::true_ {};
+	template <BOOST_PP_ENUM_PARAMS(10, class T), int Dummy>
+	struct isMultiResult<boost::tuple<BOOST_PP_ENUM_PARAMS(10, T)>, Dummy> : mpl::true_ {};
+	template <class H, class T, int Dummy> struct isMultiResult<boost::tuples::cons<H, T>, Dummy> : mpl::true_ {};
+#ifdef LUABINDER_HAS_STD_TUPLE
+	template <class... Ts, int Dummy> struct isMultiResult<std::tuple<Ts...>, Dummy> : mpl::true_ {};
+#endif
 
 	template <class T, int Dummy = 0> struct purify : boost::remove_cv<typename boost::remove_pointer<typename remove_cv_ref<T>::type>::type> {};
 	template <int Dummy> struct purify<const char*, Dummy> : mpl::identity<const char*> {};
+	template <int Dummy> struct purify<char*, Dummy> : mpl::identity<const char*> {};
 
 	LuaTypesManager() {}
 
 	LuaTypesManager(const boost::shared_ptr<std::vector<TypeManagerDetail::StackImplBase::MetaData*> >& data) :
-	TypeManagerDetail::StackImpl<TypesList, 0 > (data) {}
+	TypeManagerDetail::StackImpl<TypesList> (data) {}
 	typedef TypesList tlist;
 	typedef LuaTypesManager<TypesList> type;
 	typedef boost::shared_ptr<LuaTypesManager<tlist> > pointer;
@@ -431,14 +1401,22 @@ public:
 	template <class T> inline typename AddedType<T>::type::pointer
 		registerType(const std::string& name, lua_State* state)
 	{
-		TypeManagerDetail::StackImplBase::MetaData* temp =
-			new (TypeManagerDetail::allocateLuaSpace<TypeManagerDetail::StackImplBase::MetaData > (state, "LUABINDMetaData"))
-			TypeManagerDetail::StackImplBase::MetaData;
+		// Индекс типа в реестре совпадает с номером его MetaData, повторная регистрация их бы рассогласовала
+		BOOST_STATIC_ASSERT(!hasType<T>::value);
+		// Реестр MetaData общий для всей цепочки менеджеров (методы и свойства, зарегистрированные у менеджера базы,
+		// видят наследников), поэтому регистрировать можно только у последнего менеджера цепочки.
+		// Второй тип от того же менеджера получил бы номер, не совпадающий с его индексом в своем списке типов
+		if (this->TypeManagerDetail::StackImplBase::mdata->size() != static_cast<std::size_t> (mpl::size<TypesList>::value))
+			throw LuaException("Cannot register type " + name + ": types manager already has a successor, register on the newest one");
+		int anchor;
+		TypeManagerDetail::StackImplBase::MetaData* temp = TypeManagerDetail::StackImplBase::newMetaData(state, anchor);
+		boost::get_deleter<TypeManagerDetail::StackImplBase::MetaDataRelease>(this->TypeManagerDetail::StackImplBase::mdata)
+			->anchors.push_back(std::make_pair(state, anchor));
+		temp->id = static_cast<unsigned int> (this->TypeManagerDetail::StackImplBase::mdata->size());
 		temp->name = name;
 		temp->staticInfoGetter = & TypeManagerDetail::templatedTypeid<T> ;
 		this->TypeManagerDetail::StackImplBase::mdata->push_back(temp);
 		boost::shared_ptr<std::vector<TypeManagerDetail::StackImplBase::MetaData*> > myvec = this->TypeManagerDetail::StackImplBase::mdata;
-		this->TypeManagerDetail::StackImplBase::mdata.reset();
 		// Устанавливаем метатаблицу, если ее нет
 		if (luaL_newmetatable(state, name.c_str())) // Lua Stack +1 meta
 		{
@@ -450,11 +1428,174 @@ public:
 			lua_pushvalue(state, -2); //Lua Stack +3 meta "__index" meta
 			lua_rawset(state, -3); // Lua Stack +1 meta
 		}
-		lua_pop(state, 1);
+		// Сохраняем ссылку, чтобы при каждом push не искать метатаблицу по имени
+		// Метатаблица заимствованных указателей: без __gc, методы берутся из основной
+		lua_newtable(state); // Lua Stack +2 meta bmeta
+		lua_pushstring(state, "__index"); //Lua Stack +3 meta bmeta "__index"
+		lua_pushvalue(state, -3); //Lua Stack +4 meta bmeta "__index" meta
+		lua_rawset(state, -3); // Lua Stack +2 meta bmeta
+		temp->borrowedMetaRef = luaL_ref(state, LUA_REGISTRYINDEX); // Lua Stack +1 meta
+		temp->metaRef = luaL_ref(state, LUA_REGISTRYINDEX); // Lua Stack 0
+		// Кэш объектов для CachedPointerPolicy
+		lua_newtable(state); // Lua Stack +1 cache
+		lua_newtable(state); // Lua Stack +2 cache meta
+		lua_pushstring(state, "v"); // Lua Stack +3 cache meta "v"
+		lua_setfield(state, -2, "__mode"); // Lua Stack +2 cache meta
+		lua_setmetatable(state, -2); // Lua Stack +1 cache
+		temp->cacheRef = luaL_ref(state, LUA_REGISTRYINDEX); // Lua Stack 0
 
 		return typename AddedType<T>::type::pointer
 			(new typename AddedType<T>::type(myvec));
 	}
+
+	// Регистрирует T как наследника зарегистрированного Base: объекты T принимаются везде, где ожидается Base
+	// (и любой из базовых типов Base), методы и свойства Base доступны у объектов T
+	template <class T, class Base> inline typename AddedType<T>::type::pointer
+		registerType(const std::string& name, lua_State* state)
+	{
+		BOOST_STATIC_ASSERT(hasType<Base>::value);
+		BOOST_STATIC_ASSERT((boost::is_base_of<Base, T>::value));
+		// Смещение до виртуальной базы зависит от объекта, таблица смещений для нее не годится
+		BOOST_STATIC_ASSERT(!(boost::is_virtual_base_of<Base, T>::value));
+		typename AddedType<T>::type::pointer result = registerType<T> (name, state);
+		const std::vector<TypeManagerDetail::StackImplBase::MetaData*>& metas = *this->TypeManagerDetail::StackImplBase::mdata;
+		const unsigned int baseId = TypeManagerDetail::TypeRegistry<TypesList>::template index<Base>::value;
+		TypeManagerDetail::StackImplBase::MetaData* base = metas[baseId];
+		TypeManagerDetail::StackImplBase::MetaData* derived = metas.back();
+		const std::ptrdiff_t offset = TypeManagerDetail::baseOffset<T, Base>();
+		derived->upcast.assign(derived->id, TypeManagerDetail::StackImplBase::noCast());
+		for (std::size_t i = 0; i < base->upcast.size(); ++i)
+			if (base->upcast[i] != TypeManagerDetail::StackImplBase::noCast())
+				derived->upcast[i] = base->upcast[i] + offset;
+		derived->upcast[baseId] = offset;
+
+		// Методы и свойства ищутся сначала у T, затем по цепочке у базовых типов
+		this->_pushProperties(state, derived->id); // Lua Stack +1 props
+		this->_pushProperties(state, baseId); // Lua Stack +2 props baseprops
+		lua_rawgeti(state, LUA_REGISTRYINDEX, derived->metaRef); // Lua Stack +3 props baseprops meta
+		lua_rawgeti(state, LUA_REGISTRYINDEX, base->metaRef); // Lua Stack +4 props baseprops meta basemeta
+		TypeManagerDetail::setIndexFallback(state, -2, -1); // Lua Stack +4
+		TypeManagerDetail::setIndexFallback(state, -4, -3); // Lua Stack +4
+		// Метаметоды Base копируются в обе метатаблицы T, метаметоды Base, зарегистрированные позже, - в inheritMetamethod
+		lua_rawgeti(state, LUA_REGISTRYINDEX, derived->borrowedMetaRef); // Lua Stack +5 props baseprops meta basemeta bmeta
+		TypeManagerDetail::copyMetamethods(state, -2, -3); // Lua Stack +5
+		TypeManagerDetail::copyMetamethods(state, -2, -1); // Lua Stack +5
+		lua_pop(state, 5); // Lua Stack 0
+		return result;
+	}
+
+	// Lua Stack 0. Метаметод metaName, только что поставленный типу typeName (значение func на стеке),
+	// получают его наследники, у которых было прежнее значение previous (унаследованное) или не было никакого
+	inline void inheritMetamethod(lua_State* state, const char* typeName, const char* metaName, int previous, int func) const
+	{
+		if (previous < 0 && previous > LUA_REGISTRYINDEX)
+			previous = lua_gettop(state) + previous + 1;
+		if (func < 0 && func > LUA_REGISTRYINDEX)
+			func = lua_gettop(state) + func + 1;
+		const std::vector<TypeManagerDetail::StackImplBase::MetaData*>& metas = *this->TypeManagerDetail::StackImplBase::mdata;
+		std::size_t baseId = 0;
+		while (baseId < metas.size() && metas[baseId]->name != typeName)
+			++baseId;
+		for (std::size_t i = baseId + 1; i < metas.size(); ++i)
+		{
+			if (metas[i]->upcast.size() <= baseId || metas[i]->upcast[baseId] == TypeManagerDetail::StackImplBase::noCast())
+				continue;
+			const int refs[] = { metas[i]->metaRef, metas[i]->borrowedMetaRef };
+			for (int r = 0; r < 2; ++r)
+			{
+				// Метатаблица наследника ищет промахи в метатаблице базы, поэтому чтение без __index
+				lua_rawgeti(state, LUA_REGISTRYINDEX, refs[r]); // Lua Stack +1 meta
+				lua_pushstring(state, metaName); // Lua Stack +2 meta name
+				lua_rawget(state, -2); // Lua Stack +2 meta own
+				if (lua_isnil(state, -1) || lua_rawequal(state, -1, previous))
+				{
+					lua_pushvalue(state, func); // Lua Stack +3 meta own func
+					lua_setfield(state, -3, metaName); // Lua Stack +2 meta own
+				}
+				lua_pop(state, 2); // Lua Stack 0
+			}
+		}
+	}
+
+	// Удаляет объект из кэша CachedPointerPolicy, следующая передача создаст новый userdata
+	template <class T>
+	inline void forgetObject(lua_State* L, const T* obj) const
+	{
+		_iforgetObject(L, obj);
+	}
+
+	// Память под объект T внутри нового userdata (Lua Stack +1 udata), после конструирования
+	// объекта в ней нужно вызвать commitInPlace<T>
+	template <class T>
+	inline void* allocInPlace(lua_State* L) const
+	{
+		return _iallocInPlace(L, Type2Type<T>());
+	}
+
+	template <class T>
+	inline void commitInPlace(lua_State* L) const
+	{
+		_icommitInPlace(L, Type2Type<T>());
+	}
+
+	// Lua Stack +1 meta, метатаблица зарегистрированного типа T
+	template <class T>
+	inline void pushTypeMetatable(lua_State* L, bool borrowed = false) const
+	{
+		const TypeManagerDetail::StackImplBase::MetaData* data =
+			(*this->TypeManagerDetail::StackImplBase::mdata)[TypeManagerDetail::TypeRegistry<TypesList>::template index<T>::value];
+		lua_rawgeti(L, LUA_REGISTRYINDEX, borrowed ? data->borrowedMetaRef : data->metaRef); // Lua Stack +1 meta
+	}
+
+	// Имя, под которым зарегистрирован тип T
+	template <class T>
+	inline const std::string& typeName() const
+	{
+		return (*this->TypeManagerDetail::StackImplBase::mdata)[TypeManagerDetail::TypeRegistry<TypesList>::template index<T>::value]->name;
+	}
+#ifdef LUABINDER_PROFILE
+
+	inline std::size_t userdataCount() const
+	{
+		return this->allocatedUserdata;
+	}
+#endif
+
+	// Lua Stack +1 props. Таблица свойств типа T создается при первом обращении,
+	// тогда же __index и __newindex обеих метатаблиц типа заменяются на функции доступа к свойствам
+	template <class T>
+	inline void pushProperties(lua_State* L) const
+	{
+		this->_pushProperties(L, TypeManagerDetail::TypeRegistry<TypesList>::template index<T>::value);
+	}
+
+	// Объект зарегистрированного типа T (или const T) по индексу стека, без общих преобразований getFromStack
+	template <class T>
+	inline T* getSelf(lua_State* L, int idx) const
+	{
+		return _igetFromStack(L, idx, Type2Type<T*>());
+	}
+
+	// Является ли значение по индексу стека объектом типа с номером typeId (или его наследника).
+	// В отличие от getFromStack не бросает исключений
+	inline bool isObject(lua_State* L, int idx, unsigned int typeId) const
+	{
+		const TypeManagerDetail::StackImplBase::OpsHolder* holder = this->holderAt(L, idx);
+		return holder && this->castObject(holder, typeId) != 0;
+	}
+
+	// Кладет на стек метатаблицу зарегистрированного типа, возвращает false если тип не найден
+	inline bool pushMetatable(lua_State* state, const char* name, bool borrowed = false) const
+	{
+		const std::vector<TypeManagerDetail::StackImplBase::MetaData*>& metas = *this->TypeManagerDetail::StackImplBase::mdata;
+		for (std::size_t i = 0; i < metas.size(); ++i)
+			if (metas[i]->name == name)
+			{
+				lua_rawgeti(state, LUA_REGISTRYINDEX, borrowed ? metas[i]->borrowedMetaRef : metas[i]->metaRef); // Lua Stack +1 meta
+				return true;
+			}
+		return false;
+	}
 protected:
 
 	inline int _igetFromStack(lua_State* L, int ind, Type2Type<int>) const
@@ -465,10 +1606,18 @@ protected:
 	}
 	inline std::string _igetFromStack(lua_State* L, int ind, Type2Type<std::string>) const
 	{
-		if (lua_isstring(L, ind))
-			return std::string(lua_tostring(L, ind));
+		std::size_t len;
+		if (const char* str = lua_isstring(L, ind) ? lua_tolstring(L, ind, &len) : 0)
+			return std::string(str, len);
 		throw LuaConvertError(ind, "std::string");
 	}
+	inline LuaStringRef _igetFromStack(lua_State* L, int ind, Type2Type<LuaStringRef>) const
+	{
+		std::size_t len;
+		if (const char* str = lua_isstring(L, ind) ? lua_tolstring(L, ind, &len) : 0)
+			return LuaStringRef(str, len);
+		throw LuaConvertError(ind, "string");
+	}
 	inline const char* _igetFromStack(lua_State* L, int ind, Type2Type<const char*>) const
 	{
 		if (lua_isstring(L, ind))
@@ -481,6 +1630,88 @@ protected:
 			return lua_tonumber(L, ind);
 		throw LuaConvertError(ind, "float");
 	}
+	inline double _igetFromStack(lua_State* L, int ind, Type2Type<double>) const
+	{
+		if (lua_isnumber(L, ind))
+			return lua_tonumber(L, ind);
+		throw LuaConvertError(ind, "double");
+	}
+	// Как и в Lua, ложны только nil и false
+	inline bool _igetFromStack(lua_State* L, int ind, Type2Type<bool>) const
+	{
+		return lua_toboolean(L, ind) != 0;
+	}
+	// Остальные целые типы (unsigned, 64-битные, char) и перечисления
+	template <class T>
+	inline typename boost::enable_if<mpl::or_<boost::is_integral<T>, boost::is_enum<T> >, T>::type
+		_igetFromStack(lua_State* L, int ind, Type2Type<T>) const
+	{
+		if (lua_isnumber(L, ind))
+			return TypeManagerDetail::fromLuaNumber<T > (lua_tonumber(L, ind));
+		throw LuaConvertError(ind, boost::is_enum<T>::value ? "enum" : "integer");
+	}
+	// nil допустим: аргумент может быть чисто выходным
+	template <class T>
+	inline TypeManagerDetail::ValueArg<T> _igetFromStack(lua_State* L, int ind, Type2Type<TypeManagerDetail::ValueArg<T> >) const
+	{
+		if (lua_isnoneornil(L, ind))
+			return TypeManagerDetail::ValueArg<T > ();
+		return TypeManagerDetail::ValueArg<T > (getFromStack<T > (L, ind));
+	}
+	template <class T>
+	inline LuaArrayView<T> _igetFromStack(lua_State* L, int ind, Type2Type<LuaArrayView<T> >) const
+	{
+		if (lua_type(L, ind) == LUA_TUSERDATA && lua_objlen(L, ind) == sizeof (TypeManagerDetail::ArrayViewHolder<T>))
+		{
+			const TypeManagerDetail::ArrayViewHolder<T>* holder =
+				reinterpret_cast<const TypeManagerDetail::ArrayViewHolder<T>*> (lua_touserdata(L, ind));
+			if (holder->tag == & TypeManagerDetail::templatedTypeid<LuaArrayView<T> >)
+				return holder->view;
+		}
+		throw LuaConvertError(ind, "array view");
+	}
+
+	// Массив Lua в std::vector, память резервируется сразу по длине таблицы
+	template <class T, class A>
+	inline std::vector<T, A> _igetFromStack(lua_State* L, int ind, Type2Type<std::vector<T, A> >) const
+	{
+		if (!lua_istable(L, ind))
+			throw LuaConvertError(ind, "std::vector");
+		TypeManagerDetail::StackGuard guard(L);
+		if (ind < 0 && ind > LUA_REGISTRYINDEX)
+			ind = lua_gettop(L) + ind + 1;
+		std::size_t n = lua_objlen(L, ind);
+		std::vector<T, A> result;
+		result.reserve(n);
+		for (std::size_t i = 1; i <= n; ++i)
+		{
+			lua_rawgeti(L, ind, static_cast<int> (i)); // Lua Stack +1 value
+			result.push_back(getFromStack<T>(L, lua_gettop(L)));
+			lua_pop(L, 1); // Lua Stack 0
+		}
+		return result;
+	}
+
+	template <class K, class V, class C, class A>
+	inline std::map<K, V, C, A> _igetFromStack(lua_State* L, int ind, Type2Type<std::map<K, V, C, A> >) const
+	{
+		if (!lua_istable(L, ind))
+			throw LuaConvertError(ind, "std::map");
+		TypeManagerDetail::StackGuard guard(L);
+		if (ind < 0 && ind > LUA_REGISTRYINDEX)
+			ind = lua_gettop(L) + ind + 1;
+		std::map<K, V, C, A> result;
+		lua_pushnil(L); // Lua Stack +1 nil
+		while (lua_next(L, ind)) // Lua Stack +2 key value
+		{
+			// Ключ преобразуется из копии: lua_tostring изменил бы ключ и сломал lua_next
+			lua_pushvalue(L, -2); // Lua Stack +3 key value key
+			int top = lua_gettop(L);
+			result.insert(std::make_pair(getFromStack<K>(L, top), getFromStack<V>(L, top - 1)));
+			lua_pop(L, 2); // Lua Stack +1 key
+		}
+		return result;
+	}
 
 	template <class SavePolicy>
 	inline void _ipushToStack(lua_State* L, int number, Type2Type<int>) const
@@ -495,20 +1726,83 @@ protected:
 	template <class SavePolicy>
 	inline void _ipushToStack(lua_State* L, const std::string& str, Type2Type<std::string>) const
 	{
-		lua_pushstring(L, str.c_str());
+		lua_pushlstring(L, str.data(), str.size());
+	}
+	template <class SavePolicy>
+	inline void _ipushToStack(lua_State* L, const LuaStringRef& str, Type2Type<LuaStringRef>) const
+	{
+		lua_pushlstring(L, str.data(), str.size());
 	}
 	template <class SavePolicy>
 	inline void _ipushToStack(lua_State* L, float num, Type2Type<float>) const
 	{
 		lua_pushnumber(L, num);
 	}
-	using TypeManagerDetail::StackImpl<TypesList, 0 > ::_igetFromStack;
-	using TypeManagerDetail::StackImpl<TypesList, 0 > ::_ipushToStack;
+	template <class SavePolicy>
+	inline void _ipushToStack(lua_State* L, double num, Type2Type<double>) const
+	{
+		lua_pushnumber(L, num);
+	}
+	template <class SavePolicy>
+	inline void _ipushToStack(lua_State* L, bool value, Type2Type<bool>) const
+	{
+		lua_pushboolean(L, value);
+	}
+	template <class SavePolicy, class T>
+	inline typename boost::enable_if<mpl::or_<boost::is_integral<T>, boost::is_enum<T> > >::type
+		_ipushToStack(lua_State* L, T value, Type2Type<T>) const
+	{
+		lua_pushnumber(L, TypeManagerDetail::toLuaNumber(value));
+	}
+	// Lua Stack +1 table
+	template <class SavePolicy, class T, class A>
+	inline void _ipushToStack(lua_State* L, const std::vector<T, A>& vec, Type2Type<std::vector<T, A> >) const
+	{
+		lua_createtable(L, static_cast<int> (vec.size()), 0); // Lua Stack +1 table
+		for (std::size_t i = 0; i < vec.size(); ++i)
+		{
+			pushToStack(L, vec[i], SavePolicy()); // Lua Stack +2 table value
+			lua_rawseti(L, -2, static_cast<int> (i + 1)); // Lua Stack +1 table
+		}
+	}
+
+	// Lua Stack +1 table
+	template <class SavePolicy, class K, class V, class C, class A>
+	inline void _ipushToStack(lua_State* L, const std::map<K, V, C, A>& m, Type2Type<std::map<K, V, C, A> >) const
+	{
+		lua_createtable(L, 0, static_cast<int> (m.size())); // Lua Stack +1 table
+		for (typename std::map<K, V, C, A>::const_iterator it = m.begin(); it != m.end(); ++it)
+		{
+			pushToStack(L, it->first, SavePolicy()); // Lua Stack +2 table key
+			pushToStack(L, it->second, SavePolicy()); // Lua Stack +3 table key value
+			lua_rawset(L, -3); // Lua Stack +1 table
+		}
+	}
+
+	// Lua Stack +1 udata
+	template <class SavePolicy, class T>
+	inline void _ipushToStack(lua_State* L, const LuaArrayView<T>& view, Type2Type<LuaArrayView<T> >) const
+	{
+		LUABINDER_PROFILE_ALLOC();
+		new (lua_newuserdata(L, sizeof (TypeManagerDetail::ArrayViewHolder<T>))) TypeManagerDetail::ArrayViewHolder<T>(view); // Lua Stack +1 udata
+		luaL_getmetatable(L, TypeManagerDetail::arrayViewName<T>()); // Lua Stack +2 udata meta
+		if (!lua_istable(L, -1))
+		{
+			lua_pop(L, 2);
+			throw LuaException("Array view of this type is not registered, use LuaEngine::regArray");
+		}
+		lua_setmetatable(L, -2); // Lua Stack +1 udata
+	}
+	using TypeManagerDetail::StackImpl<TypesList> ::_igetFromStack;
+	using TypeManagerDetail::StackImpl<TypesList> ::_ipushToStack;
+	using TypeManagerDetail::StackImpl<TypesList> ::_iforgetObject;
+	using TypeManagerDetail::StackImpl<TypesList> ::_iallocInPlace;
+	using TypeManagerDetail::StackImpl<TypesList> ::_icommitInPlace;
 
 	template <class T> struct _dereference
 	{
 		static inline T & apply(T * _o) {return *_o;}
-		typedef Type2Type<T> type;
+		typedef Type2Type<typename boost::remove_cv<T>::type> type;
 	};
 	template <class T> struct _identity
 	{
@@ -518,10 +1812,13 @@ protected:
 
 	template <class T> struct _getIdentity
 	{
-		static inline T & apply(T& _o, lua_State*) {return _o;}
 		static inline T & apply(T* _o, lua_State*) {return *_o;}
-		typedef typename mpl::if_<boost::is_pointer<T>,
-			Type2Type<T>, Type2Type<T*> >::type type;
+		typedef Type2Type<T*> type;
+	};
+	template <class T> struct _getIdentity<T*>
+	{
+		static inline T * apply(T* _o, lua_State*) {return _o;}
+		typedef Type2Type<T*> type;
 	};
 	template <class T, int Dummy = 0> struct _getScalar
 	{
@@ -530,46 +1827,89 @@ protected:
 	};
 	template <class T, int Dummy> struct _getScalar<T*, Dummy>
 	{
-		static inline T * apply(T _o, lua_State * L)
-		{
-			T* temp = new (TypeManagerDetail::allocateLuaSpace<T > (L, typeid (T).name(), false)) T(_o);
-			lua_pop(L, 1);
-			return temp;
-		}
-		typedef Type2Type<typename boost::remove_cv<T>::type > type;
+		typedef TypeManagerDetail::ValueArg<typename boost::remove_cv<T>::type> holderType;
+		static inline const holderType& apply(const holderType& _o, lua_State*) {return _o;}
+		typedef Type2Type<holderType> type;
 	};
 
 	template <int Dummy> struct _getScalar<const char*, Dummy>
 	{
-		static inline const char* apply(const char* _o, lua_State * L) {return _o;}
+		static inline const char* apply(const char* _o, lua_State*) {return _o;}
 		typedef Type2Type<const char*> type;
 	};
+
+	// Тип возврата getFromStack: указатели на незарегистрированные типы получают ValueArg
+	template <class T, int Dummy = 0> struct _getResult : getTraits<T> {};
+	template <class T, int Dummy> struct _getResult<T*, Dummy> :
+	mpl::if_<hasType<typename boost::remove_cv<T>::type>,
+		T*,
+		TypeManagerDetail::ValueArg<typename boost::remove_cv<T>::type> > {};
+	template <int Dummy> struct _getResult<const char*, Dummy> : mpl::identity<const char*> {};
+
+#ifdef LUABINDER_HAS_STD_TUPLE
+	template <class SavePolicy, std::size_t I, class Tuple>
+	inline int _pushTuple(lua_State* L, const Tuple& t, mpl::false_) const
+	{
+		pushToStack(L, std::get<I>(t), SavePolicy());
+		return 1 + _pushTuple<SavePolicy, I + 1>(L, t, mpl::bool_<I + 1 == std::tuple_size<Tuple>::value>());
+	}
+	template <class SavePolicy, std::size_t I, class Tuple>
+	inline int _pushTuple(lua_State*, const Tuple&, mpl::true_) const
+	{
+		return 0;
+	}
+#endif
 public:
+	// Тип, возвращаемый getFromStack<T>
+	template <class T> struct fromStackType : _getResult<T> {};
 
 	template <class T>
-	inline typename getTraits<T>::type getFromStack(lua_State* L, int idx)const
+	inline typename _getResult<T>::type getFromStack(lua_State* L, int idx)const
 	{
-		typedef typename mpl::if_ < mpl::contains<TypesList, typename boost::remove_cv<typename boost::remove_pointer<T>::type>::type>,
+		typedef typename mpl::if_ < hasType<typename boost::remove_cv<typename boost::remove_pointer<T>::type>::type>,
 			_getIdentity<T>,
 			_getScalar<T> >::type decisiveType;
-		return typename getTraits<T>::type(decisiveType::apply(_igetFromStack(L, idx, typename decisiveType::type()), L));
+		return typename _getResult<T>::type(decisiveType::apply(_igetFromStack(L, idx, typename decisiveType::type()), L));
 	}
 
 	template <class SavePolicy, class T>
 	inline void pushToStack(lua_State* L, T* obj, SavePolicy) const
 	{
-		typedef typename mpl::if_<mpl::contains<TypesList, T>,
+		typedef typename mpl::if_<hasType<T>,
 			_identity<T>, _dereference<T> >::type decisiveType;
-		_ipushToStack<SavePolicy > (L, decisiveType::apply(obj), decisiveType::type());
+		_ipushToStack<SavePolicy > (L, decisiveType::apply(obj), typename decisiveType::type());
 	}
 
 	template <class SavePolicy, class T>
 	inline void pushToStack(lua_State* L, const T* obj, SavePolicy) const
 	{
-		typedef typename mpl::if_<mpl::contains<TypesList, T>,
+		typedef typename mpl::if_<hasType<T>,
 			_identity<const T>, _dereference<const T> >::type decisiveType;
-		_ipushToStack<SavePolicy > (L, decisiveType::apply(obj), decisiveType::type());
+		_ipushToStack<SavePolicy > (L, decisiveType::apply(obj), typename decisiveType::type());
+	}
+
+	template <class SavePolicy>
+	inline void pushToStack(lua_State* L, const char* str, SavePolicy) const
+	{
+		_ipushToStack<SavePolicy > (L, str, Type2Type<const char*>());
+	}
+
+	// char* - строка, а не указатель на один символ
+	template <class SavePolicy>
+	inline void pushToStack(lua_State* L, char* str, SavePolicy) const
+	{
+		_ipushToStack<SavePolicy > (L, str, Type2Type<const char*>());
+	}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	// Временные объекты зарегистрированных типов (результаты функций по значению) перемещаются
+	template <class SavePolicy, class T>
+	inline typename boost::enable_if<hasType<T> >::type
+		pushToStack(lua_State* L, T&& obj, SavePolicy) const
+	{
+		_ipushToStack<SavePolicy > (L, static_cast<T&&> (obj), Type2Type<T>());
 	}
+#endif
 
 	template <class SavePolicy, class T>
 	inline void pushToStack(lua_State* L, T& obj, SavePolicy) const
@@ -585,16 +1925,46 @@ public:
 		// Если тип зарегистрирован, но не находится в TypesList,
 		// то передаем уже имеющимся функциям
 		//std::cout << "Const push to stack" << std::endl;
-		typedef typename mpl::if_<mpl::contains<TypesList, T>,
+		typedef typename mpl::if_<hasType<T>,
 			Type2Type<const T>,
 			Type2Type<T> >::type decisiveType;
 		_ipushToStack<SavePolicy > (L, obj, decisiveType());
 	}
 
-	template <class T>
-	inline void pushToStack(lua_State* L, T* obj) const
+	// Lua Stack +N, pair и tuple раскладываются в отдельные значения. Возвращает N
+	template <class SavePolicy, class T1, class T2>
+	inline int pushResults(lua_State* L, const std::pair<T1, T2>& p, SavePolicy) const
 	{
-		pushToStack(L, obj, StdPointerPolicy());
+		pushToStack(L, p.first, SavePolicy());
+		pushToStack(L, p.second, SavePolicy());
+		return 2;
+	}
+
+	template <class SavePolicy, class H, class T>
+	inline int pushResults(lua_State* L, const boost::tuples::cons<H, T>& t, SavePolicy) const
+	{
+		pushToStack(L, t.get_head(), SavePolicy());
+		return 1 + pushResults(L, t.get_tail(), SavePolicy());
+	}
+
+	template <class SavePolicy>
+	inline int pushResults(lua_State*, const boost::tuples::null_type&, SavePolicy) const
+	{
+		return 0;
+	}
+
+#ifdef LUABINDER_HAS_STD_TUPLE
+	template <class SavePolicy, class... Ts>
+	inline int pushResults(lua_State* L, const std::tuple<Ts...>& t, SavePolicy) const
+	{
+		return _pushTuple<SavePolicy, 0>(L, t, mpl::bool_<sizeof...(Ts) == 0>());
+	}
+#endif
+
+	template <class T>
+	inline void pushToStack(lua_State* L, T* obj) const
+	{
+		pushToStack(L, obj, StdPointerPolicy());
 	}
 
 	template <class T>
@@ -618,186 +1988,2246 @@ public:
 
 typedef LuaTypesManager<mpl::vector<> > LTypesManager;
 
+namespace TypeManagerDetail
+{
+	// Тип Lua, из которого читается аргумент T. LUA_TNONE - подходит любое значение
+	template <class T> inline int argLuaType(Type2Type<T>)
+	{
+		return boost::is_arithmetic<T>::value || boost::is_enum<T>::value ? LUA_TNUMBER : LUA_TNONE;
+	}
+	template <class T> inline int argLuaType(Type2Type<T*>) { return LUA_TNONE; }
+	template <class T> inline int argLuaType(Type2Type<LuaArrayView<T> >) { return LUA_TUSERDATA; }
+	template <class T, class A> inline int argLuaType(Type2Type<std::vector<T, A> >) { return LUA_TTABLE; }
+	template <class K, class V, class C, class A> inline int argLuaType(Type2Type<std::map<K, V, C, A> >) { return LUA_TTABLE; }
+	inline int argLuaType(Type2Type<bool>) { return LUA_TNONE; }
+	inline int argLuaType(Type2Type<const char*>) { return LUA_TSTRING; }
+	inline int argLuaType(Type2Type<std::string>) { return LUA_TSTRING; }
+	inline int argLuaType(Type2Type<LuaStringRef>) { return LUA_TSTRING; }
+
+	// Признак аргумента для выбора перегрузки. Сравнивается только тип Lua (и тип объекта для userdata),
+	// без пробных преобразований
+	struct ArgTag
+	{
+		int luaType;
+		// Номер зарегистрированного типа или -1
+		int typeId;
+		// Выходной параметр в конце списка, его можно не передавать
+		bool optional;
+	};
+
+	// Одна сигнатура перегруженной функции
+	struct OverloadEntry : boost::noncopyable
+	{
+		std::vector<ArgTag> tags;
+#ifdef LUABINDER_PROFILE
+		LuaBindingStats* stats;
+#endif
+
+		virtual ~OverloadEntry() {}
+		virtual int invoke(lua_State* L) const = 0;
+		virtual bool isObject(lua_State* L, int idx, unsigned int typeId) const = 0;
+
+		// Аргументы 1..lua_gettop(L) подходят по признакам
+		bool match(lua_State* L) const
+		{
+			int top = lua_gettop(L);
+			for (int i = 0; i < top; ++i)
+			{
+				const ArgTag& tag = tags[i];
+				if (tag.luaType == LUA_TNONE)
+					continue;
+				if (lua_type(L, i + 1) != tag.luaType)
+					return false;
+				if (tag.typeId >= 0 && !isObject(L, i + 1, tag.typeId))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	// Все сигнатуры одного имени, разложенные по числу аргументов. Хранится в userdata - upvalue callOverload
+	struct OverloadSet
+	{
+		std::string name;
+		std::vector<std::vector<OverloadEntry*> > byArity;
+#ifdef LUABINDER_PROFILE
+		// Общая запись профиля всех сигнатур
+		LuaBindingStats* stats;
+#endif
+
+		~OverloadSet()
+		{
+			for (std::size_t i = 0; i < byArity.size(); ++i)
+				for (std::size_t j = 0; j < byArity[i].size(); ++j)
+					if (byArity[i][j]->tags.size() == i)
+						delete byArity[i][j];
+		}
+
+		// Сигнатура доступна с числом аргументов от числа обязательных до полного
+		void add(OverloadEntry* entry)
+		{
+#ifdef LUABINDER_PROFILE
+			entry->stats = stats;
+#endif
+			std::size_t arity = entry->tags.size(), minArity = arity;
+			while (minArity > 0 && entry->tags[minArity - 1].optional)
+				--minArity;
+			if (byArity.size() <= arity)
+				byArity.resize(arity + 1);
+			for (std::size_t i = minArity; i <= arity; ++i)
+				byArity[i].push_back(entry);
+		}
+	};
+
+	// Вызов перегруженной функции: кандидаты берутся по lua_gettop, единственный вызывается сразу,
+	// из нескольких - первый зарегистрированный, чьи признаки совпали с аргументами
+	inline int callOverload(lua_State* L)
+	{
+		const OverloadSet* set = reinterpret_cast<const OverloadSet*> (lua_touserdata(L, lua_upvalueindex(1)));
+		std::size_t top = static_cast<std::size_t> (lua_gettop(L));
+		if (top < set->byArity.size())
+		{
+			const std::vector<OverloadEntry*>& candidates = set->byArity[top];
+			if (candidates.size() == 1)
+				return candidates.front()->invoke(L);
+			for (std::size_t i = 0; i < candidates.size(); ++i)
+				if (candidates[i]->match(L))
+					return candidates[i]->invoke(L);
+		}
+#ifdef LUABINDER_PROFILE
+		++set->stats->calls;
+		++set->stats->convertErrors;
+#endif
+		luaL_where(L, 1);
+		lua_pushfstring(L, "no overload of '%s' matches arguments (", set->name.c_str());
+		lua_concat(L, 2); // Lua Stack +1 msg
+		for (std::size_t i = 1; i <= top; ++i)
+		{
+			lua_pushstring(L, luaL_typename(L, static_cast<int> (i)));
+			lua_pushstring(L, i < top ? ", " : "");
+			lua_concat(L, 3); // Lua Stack +1 msg
+		}
+		lua_pushliteral(L, ")");
+		lua_concat(L, 2); // Lua Stack +1 msg
+		return lua_error(L);
+	}
+}
+
+// Вызов C++ функций из Lua.
+// Для каждой сигнатуры генерируется своя статическая C-функция, указатель на функцию
+// и конвертер хранятся в upvalue замыкания: без boost::function и без копирования shared_ptr на вызов
 class LuaFuncCaller
 {
 public:
-	template <class SavePolicy, typename Func,
-	class From = typename mpl::begin<typename boost::function_types::parameter_types<Func>::type>::type,
-	class End = typename mpl::end<typename boost::function_types::parameter_types<Func>::type>::type>
-	struct invoker;
+	template <int Arity> struct invoker;
+
+	// Lua Stack +1 closure. С LUABINDER_PROFILE на вершине стека должна лежать запись профиля
+	// (LUABINDER_PROFILE_RECORD), она забирается в upvalue. То же для pushMethod и pushConstructor
+	template <class SavePolicy, typename Func, class ConvertTList>
+	static inline void push(lua_State* L, Func f, const LuaTypesManager<ConvertTList>* convertor, SavePolicy)
+	{
+		new (lua_newuserdata(L, sizeof (Func))) Func(f); // Lua Stack +1 func
+		lua_pushlightuserdata(L, const_cast<LuaTypesManager<ConvertTList>*> (convertor)); // Lua Stack +2 func conv
+		LUABINDER_PROFILE_UPVALUE(L)
+		lua_pushcclosure(L, & LuaFuncCaller::call<SavePolicy, Func, ConvertTList>, 2 + LUABINDER_PROFILE_UPVALUES); // Lua Stack +1 closure
+	}
+
+	template <int Arity> struct creator;
 
-	typedef boost::function<int () > FunctionInvokerType;
+	// Методы класса: self - первый аргумент Lua, остальные аргументы сдвинуты на один
+	template <int Arity> struct methodInvoker;
 
+	// Класс (с cv-квалификаторами метода) указателя на метод
+	template <typename Func> struct selfOf :
+	boost::remove_reference<typename mpl::at_c<typename boost::function_types::parameter_types<Func>::type, 0>::type> {};
+
+	template <typename Func, class ConvertTList>
+	static inline typename selfOf<Func>::type* getSelf(lua_State* L, const LuaTypesManager<ConvertTList>* conv)
+	{
+		return conv->template getSelf<typename selfOf<Func>::type>(L, 1);
+	}
+
+	// Lua Stack +1 closure для указателя на метод
 	template <class SavePolicy, typename Func, class ConvertTList>
-	LuaFuncCaller(lua_State* L, Func f, const boost::shared_ptr<LuaTypesManager<ConvertTList> >&, SavePolicy);
+	static inline void pushMethod(lua_State* L, Func f, const LuaTypesManager<ConvertTList>* convertor, SavePolicy)
+	{
+		new (lua_newuserdata(L, sizeof (Func))) Func(f); // Lua Stack +1 func
+		lua_pushlightuserdata(L, const_cast<LuaTypesManager<ConvertTList>*> (convertor)); // Lua Stack +2 func conv
+		LUABINDER_PROFILE_UPVALUE(L)
+		lua_pushcclosure(L, & LuaFuncCaller::callMethod<SavePolicy, Func, ConvertTList>, 2 + LUABINDER_PROFILE_UPVALUES); // Lua Stack +1 closure
+	}
+
+	// Lua Stack +1 closure, создающее объект типа результата Signature
+	template <typename Signature, class ConvertTList>
+	static inline void pushConstructor(lua_State* L, const LuaTypesManager<ConvertTList>* convertor)
+	{
+		lua_pushlightuserdata(L, const_cast<LuaTypesManager<ConvertTList>*> (convertor)); // Lua Stack +1 conv
+#ifdef LUABINDER_PROFILE
+		lua_insert(L, -2);
+#endif
+		lua_pushcclosure(L, & LuaFuncCaller::construct<Signature, ConvertTList>, 1 + LUABINDER_PROFILE_UPVALUES); // Lua Stack +1 closure
+	}
+
+	template <typename Signature, class ConvertTList>
+	static int construct(lua_State* L)
+	{
+		const LuaTypesManager<ConvertTList>* conv =
+			reinterpret_cast<const LuaTypesManager<ConvertTList>*> (lua_touserdata(L, lua_upvalueindex(1)));
+		LUABINDER_PROFILE_BEGIN(lua_touserdata(L, lua_upvalueindex(2)))
+		try
+		{
+			return LUABINDER_PROFILE_RESULT(creator<boost::function_types::function_arity<Signature>::value>::template apply<Signature>(L, conv));
+		}
+		LUABINDER_PROFILE_CATCH_CONVERT
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		LUABINDER_PROFILE_FAILED()
+		return lua_error(L);
+	}
 
-	LuaFuncCaller() {}
+	// Неконстантная ссылка или указатель на незарегистрированный тип (int&, double*, std::string&) - выходной параметр:
+	// его значение после вызова возвращается в Lua дополнительным результатом
+	template <class Param, class ConvertTList> struct isOutArg :
+	mpl::and_<mpl::or_<boost::is_reference<Param>, boost::is_pointer<Param> >,
+		mpl::not_<boost::is_const<typename boost::remove_pointer<typename boost::remove_reference<Param>::type>::type> >,
+		mpl::not_<typename LuaTypesManager<ConvertTList>::template hasType<typename remove_cv_ref<typename boost::remove_pointer<Param>::type>::type> > > {};
 
-	int operator() ()
+	// Чисто выходной параметр можно не передавать из Lua
+	template <class Param, class A, class ConvertTList>
+	static inline typename LuaTypesManager<ConvertTList>::template fromStackType<A>::type
+		getArg(lua_State* L, const LuaTypesManager<ConvertTList>* conv, int idx)
 	{
-		return funcHolder();
+		return getArg<A>(L, conv, idx, typename isOutArg<Param, ConvertTList>::type());
 	}
-private:
-	FunctionInvokerType funcHolder;
-};
 
-template <class SavePolicy, typename Func, class From, class End>
-struct LuaFuncCaller::invoker
-{
-	typedef typename boost::mpl::deref<From>::type argType;
-	typedef typename boost::mpl::next<From>::type nextIter;
-	typedef typename boost::remove_reference<argType>::type clearedArgT;
+	template <class A, class ConvertTList>
+	static inline typename LuaTypesManager<ConvertTList>::template fromStackType<A>::type
+		getArg(lua_State* L, const LuaTypesManager<ConvertTList>* conv, int idx, mpl::true_)
+	{
+		if (lua_isnoneornil(L, idx))
+			return typename LuaTypesManager<ConvertTList>::template fromStackType<A>::type();
+		return conv->template getFromStack<A>(L, idx);
+	}
 
-	template <class StackIdx, class FusedArgs, class ConvertTList>
-	static inline int apply(Func f, lua_State* eng, FusedArgs argCons, const boost::shared_ptr<LuaTypesManager<ConvertTList> >& convertor)
+	template <class A, class ConvertTList>
+	static inline typename LuaTypesManager<ConvertTList>::template fromStackType<A>::type
+		getArg(lua_State* L, const LuaTypesManager<ConvertTList>* conv, int idx, mpl::false_)
 	{
-		return LuaFuncCaller::invoker<SavePolicy, Func, nextIter, End>::template apply<typename StackIdx::next > (f, eng, boost::fusion::push_back(argCons, convertor->template getFromStack<clearedArgT > (eng, StackIdx::value)), convertor);
+		return conv->template getFromStack<A>(L, idx);
 	}
-};
 
-template <class SavePolicy, typename Func, class End>
-struct LuaFuncCaller::invoker<SavePolicy, Func, End, End>
-{
-	struct invokeConvertPolicy
+	// Обертка параметра для mpl::for_each: параметры бывают ссылками, а Type2Type имеет вложенный type,
+	// который лямбда mpl сняла бы
+	template <class Param> struct paramTag {};
+
+	// Собирает признаки параметров сигнатуры для выбора перегрузки
+	template <class ConvertTList>
+	struct argTagCollector
 	{
-		template <class FusedArgs, class ConvertTList>
-		static inline int apply(Func f, lua_State* st, FusedArgs argCons, const boost::shared_ptr<LuaTypesManager<ConvertTList> >& conv)
+		std::vector<TypeManagerDetail::ArgTag>* tags;
+
+		template <class Param>
+		void operator()(paramTag<Param>) const
 		{
-			conv->pushToStack(st, boost::fusion::invoke(f, argCons), SavePolicy());
-			return 1;
+			typedef typename remove_cv_ref<Param>::type Bare;
+			typedef typename boost::remove_cv<typename boost::remove_pointer<Bare>::type>::type Pure;
+			typedef typename LuaTypesManager<ConvertTList>::template hasType<Pure>::type isObject;
+			typedef typename mpl::eval_if<isObject,
+				typename TypeManagerDetail::TypeRegistry<ConvertTList>::template index<Pure>,
+				mpl::int_<-1> >::type typeId;
+			TypeManagerDetail::ArgTag tag;
+			tag.optional = isOutArg<Param, ConvertTList>::value;
+			tag.luaType = tag.optional ? LUA_TNONE : isObject::value ? LUA_TUSERDATA : TypeManagerDetail::argLuaType(Type2Type<Bare>());
+			tag.typeId = tag.optional ? -1 : static_cast<int> (typeId::value);
+			tags->push_back(tag);
 		}
 	};
-	struct invokeOnlyPolicy
+
+	// Lua Stack +1 для выходного параметра, иначе 0. Возвращает число добавленных значений
+	template <class SavePolicy, class Param, class ConvertTList, class V>
+	static inline int pushOutArg(lua_State* L, const LuaTypesManager<ConvertTList>* conv, const V& value)
+	{
+		return pushOutArg<SavePolicy>(L, conv, value, typename isOutArg<Param, ConvertTList>::type());
+	}
+
+	template <class SavePolicy, class ConvertTList, class V>
+	static inline int pushOutArg(lua_State* L, const LuaTypesManager<ConvertTList>* conv, const V& value, mpl::true_)
+	{
+		conv->pushToStack(L, outValue(value), SavePolicy());
+		return 1;
+	}
+
+	// Значение выходного параметра: переменная для ссылки, хранилище ValueArg для указателя
+	template <class V>
+	static inline const V& outValue(const V& value)
+	{
+		return value;
+	}
+
+	template <class T>
+	static inline const T& outValue(const TypeManagerDetail::ValueArg<T>& value)
+	{
+		return *static_cast<T*> (value);
+	}
+
+	template <class SavePolicy, class ConvertTList, class V>
+	static inline int pushOutArg(lua_State*, const LuaTypesManager<ConvertTList>*, const V&, mpl::false_)
+	{
+		return 0;
+	}
+
+	template <class SavePolicy, typename Func, class ConvertTList>
+	static int call(lua_State* L)
 	{
-		template <class FusedArgs, class ConvertTList>
-		static inline int apply(Func f, lua_State*, FusedArgs argCons, const boost::shared_ptr<LuaTypesManager<ConvertTList> >&)
+		Func f = *reinterpret_cast<Func*> (lua_touserdata(L, lua_upvalueindex(1)));
+		const LuaTypesManager<ConvertTList>* conv =
+			reinterpret_cast<const LuaTypesManager<ConvertTList>*> (lua_touserdata(L, lua_upvalueindex(2)));
+		LUABINDER_PROFILE_BEGIN(lua_touserdata(L, lua_upvalueindex(3)))
+		try
 		{
-			boost::fusion::invoke(f, argCons);
-			return 0;
+			return LUABINDER_PROFILE_RESULT(invoker<boost::function_types::function_arity<Func>::value>::template apply<SavePolicy>(f, L, conv));
 		}
-	};
+		LUABINDER_PROFILE_CATCH_CONVERT
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		LUABINDER_PROFILE_FAILED()
+		return lua_error(L);
+	}
 
-	template <class StackIdx, class FusedArgs, class ConvertTList>
-	static inline int apply(Func f, lua_State* st, FusedArgs argCons, const boost::shared_ptr<LuaTypesManager<ConvertTList> >& conv)
+	template <class SavePolicy, typename Func, class ConvertTList>
+	static int callMethod(lua_State* L)
 	{
-		typedef typename boost::fusion::result_of::invoke<Func, FusedArgs>::type resType;
-		typedef LuaTypesManager<ConvertTList> myTypeManager;
-		typedef typename myTypeManager::template purify<resType>::type purifiedType;
-		typedef typename mpl::if_<typename myTypeManager::template isRegistred<purifiedType>::type,
-			invokeConvertPolicy,
-			invokeOnlyPolicy >::type myPolicy;
-		return myPolicy::apply(f, st, argCons, conv);
+		Func f = *reinterpret_cast<Func*> (lua_touserdata(L, lua_upvalueindex(1)));
+		const LuaTypesManager<ConvertTList>* conv =
+			reinterpret_cast<const LuaTypesManager<ConvertTList>*> (lua_touserdata(L, lua_upvalueindex(2)));
+		LUABINDER_PROFILE_BEGIN(lua_touserdata(L, lua_upvalueindex(3)))
+		try
+		{
+			return LUABINDER_PROFILE_RESULT(methodInvoker<boost::function_types::function_arity<Func>::value - 1>::template apply<SavePolicy>(f, L, conv));
+		}
+		LUABINDER_PROFILE_CATCH_CONVERT
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		LUABINDER_PROFILE_FAILED()
+		return lua_error(L);
 	}
 };
 
+// offset - число аргументов перед обычными: 1 у методов (self)
+#	define LUABINDER_ARG_TYPE(z, n, offset) typedef typename boost::remove_reference<typename mpl::at_c<params, n + offset>::type>::type A##n;
+#	define LUABINDER_ARG_GET(z, n, unused) conv->template getFromStack<A##n>(L, n + 1)
+// Аргументы читаются в локальные переменные по порядку, выходные параметры ссылаются на них
+#	define LUABINDER_ARG_DECL(z, n, offset) \
+	typename LuaTypesManager<ConvertTList>::template fromStackType<A##n>::type a##n( \
+		LuaFuncCaller::getArg<typename mpl::at_c<params, n + offset>::type, A##n>(L, conv, n + offset + 1));
+#	define LUABINDER_ARG_OUT(z, n, offset) \
+	results += LuaFuncCaller::pushOutArg<SavePolicy, typename mpl::at_c<params, n + offset>::type>(L, conv, a##n);
+#	define LUABINDER_INVOKER_POLICY(z, n, offset, name, call) \
+		struct name \
+		{ \
+			template <class SavePolicy, typename Func, class ConvertTList> \
+			static inline int apply(Func f, lua_State* L, const LuaTypesManager<ConvertTList>* conv) \
+			{ \
+				BOOST_PP_EXPR_IF(n, typedef typename boost::function_types::parameter_types<Func>::type params;) \
+				BOOST_PP_EXPR_IF(BOOST_PP_NOT(n), (void) L; (void) conv;) \
+				BOOST_PP_REPEAT_ ## z(n, LUABINDER_ARG_TYPE, offset) \
+				BOOST_PP_REPEAT_ ## z(n, LUABINDER_ARG_DECL, offset) \
+				int results = call; \
+				BOOST_PP_REPEAT_ ## z(n, LUABINDER_ARG_OUT, offset) \
+				return results; \
+			} \
+		};
+// callee - вызываемое выражение: f для функций, (self->*f) для методов
+#	define LUABINDER_INVOKER_BODY(z, n, offset, callee) \
+		LUABINDER_INVOKER_POLICY(z, n, offset, invokeConvertPolicy, \
+			(conv->pushToStack(L, callee(BOOST_PP_ENUM_PARAMS_Z(z, n, a)), SavePolicy()), 1)) \
+		LUABINDER_INVOKER_POLICY(z, n, offset, invokeMultiPolicy, \
+			conv->pushResults(L, callee(BOOST_PP_ENUM_PARAMS_Z(z, n, a)), SavePolicy())) \
+		LUABINDER_INVOKER_POLICY(z, n, offset, invokeOnlyPolicy, \
+			(callee(BOOST_PP_ENUM_PARAMS_Z(z, n, a)), 0)) \
+		template <class SavePolicy, typename Func, class ConvertTList> \
+		static inline int apply(Func f, lua_State* L, const LuaTypesManager<ConvertTList>* conv) \
+		{ \
+			typedef typename boost::function_types::result_type<Func>::type resType; \
+			typedef LuaTypesManager<ConvertTList> myTypeManager; \
+			typedef typename myTypeManager::template purify<resType>::type purifiedType; \
+			typedef typename mpl::eval_if<typename myTypeManager::template isMultiResult<purifiedType>::type, \
+				mpl::identity<invokeMultiPolicy>, \
+				mpl::if_<typename myTypeManager::template isRegistred<purifiedType>::type, \
+					invokeConvertPolicy, \
+					invokeOnlyPolicy> >::type myPolicy; \
+			return myPolicy::template apply<SavePolicy>(f, L, conv); \
+		}
+#	define LUABINDER_INVOKER_ITEM(z, n, unused) \
+	template <> struct LuaFuncCaller::invoker<n> \
+	{ \
+		LUABINDER_INVOKER_BODY(z, n, 0, f) \
+	};
+#	define LUABINDER_METHOD_INVOKER_ITEM(z, n, unused) \
+	template <> struct LuaFuncCaller::methodInvoker<n> \
+	{ \
+		LUABINDER_INVOKER_BODY(z, n, 1, (LuaFuncCaller::getSelf<Func>(L, conv)->*f)) \
+	};
+
+#	define LUABINDER_CREATOR_ITEM(z, n, unused) \
+	template <> struct LuaFuncCaller::creator<n> \
+	{ \
+		template <typename Signature, class ConvertTList> \
+		static inline int apply(lua_State* L, const LuaTypesManager<ConvertTList>* conv) \
+		{ \
+			typedef typename boost::function_types::result_type<Signature>::type T; \
+			BOOST_PP_EXPR_IF(n, typedef typename boost::function_types::parameter_types<Signature>::type params;) \
+			BOOST_PP_REPEAT_ ## z(n, LUABINDER_ARG_TYPE, 0) \
+			void* place = conv->template allocInPlace<T>(L); \
+			new (place) T(BOOST_PP_ENUM_ ## z(n, LUABINDER_ARG_GET, ~)); \
+			conv->template commitInPlace<T>(L); \
+			return 1; \
+		} \
+	};
+
+BOOST_PP_REPEAT(BOOST_PP_INC(LUABINDER_MAX_ARITY), LUABINDER_INVOKER_ITEM, ~)
+BOOST_PP_REPEAT(BOOST_PP_INC(LUABINDER_MAX_ARITY), LUABINDER_METHOD_INVOKER_ITEM, ~)
+BOOST_PP_REPEAT(BOOST_PP_INC(LUABINDER_MAX_ARITY), LUABINDER_CREATOR_ITEM, ~)
+#	undef LUABINDER_CREATOR_ITEM
+#	undef LUABINDER_METHOD_INVOKER_ITEM
+#	undef LUABINDER_INVOKER_ITEM
+#	undef LUABINDER_INVOKER_BODY
+#	undef LUABINDER_INVOKER_POLICY
+#	undef LUABINDER_ARG_OUT
+#	undef LUABINDER_ARG_DECL
+#	undef LUABINDER_ARG_GET
+#	undef LUABINDER_ARG_TYPE
+
+// Одна сигнатура перегруженной функции (LuaEngine::regOverload)
 template <class SavePolicy, typename Func, class ConvertTList>
-LuaFuncCaller::LuaFuncCaller(lua_State* L, Func f, const boost::shared_ptr<LuaTypesManager<ConvertTList> >& convertor, SavePolicy)
+struct LuaOverload : TypeManagerDetail::OverloadEntry
 {
-	funcHolder = boost::bind(& invoker<SavePolicy, Func>::template apply<mpl::int_ < 1 >, boost::fusion::nil, ConvertTList>, f, L, boost::fusion::nil(), convertor);
-}
+	Func f;
+	const LuaTypesManager<ConvertTList>* conv;
 
-template <class Convertor = LTypesManager>
-class LuaEngine
-{
-public:
-	LuaEngine(lua_State* state)
+	LuaOverload(Func func, const LuaTypesManager<ConvertTList>* convertor) : f(func), conv(convertor)
 	{
-		m_conv = typename Convertor::pointer(new Convertor);
-		m_state = state;
+		typedef typename boost::function_types::parameter_types<Func>::type params;
+		LuaFuncCaller::argTagCollector<ConvertTList> collector = { &tags };
+		mpl::for_each<params, LuaFuncCaller::paramTag<mpl::_1> >(collector);
 	}
-	LuaEngine(lua_State* state, const typename Convertor::pointer& p) :m_conv(p), m_state(state) {}
 
-	~LuaEngine() {}
+	virtual int invoke(lua_State* L) const
+	{
+		LUABINDER_PROFILE_BEGIN(stats)
+		try
+		{
+			return LUABINDER_PROFILE_RESULT(LuaFuncCaller::invoker<boost::function_types::function_arity<Func>::value>::template apply<SavePolicy>(f, L, conv));
+		}
+		LUABINDER_PROFILE_CATCH_CONVERT
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		LUABINDER_PROFILE_FAILED()
+		return lua_error(L);
+	}
 
-	template <class SavePolicy, class Func>
-	inline LuaEngine<Convertor>& regFunc(const char* name, Func f, SavePolicy)
+	virtual bool isObject(lua_State* L, int idx, unsigned int typeId) const
 	{
-		//funcsToCall.insert(std::make_pair(name, LuaFuncCaller(m_state, f, *m_conv)));
-		new(TypeManagerDetail::allocateLuaSpace<LuaFuncCaller > (m_state, "LuaFuncCaller", false))
-			LuaFuncCaller(m_state, f, m_conv, SavePolicy());
-		//lua_pushlightuserdata(m_state, &(funcsToCall[name]));
-		lua_pushcclosure(m_state, & LuaEngine<Convertor>::cfuncCaller, 1);
-		lua_setfield(m_state, LUA_GLOBALSINDEX, name);
-		return *this;
+		return conv->isObject(L, idx, typeId);
 	}
+};
 
-	template <class SavePolicy, class Func>
-	inline LuaEngine<Convertor>& regMeta(const char* typeName, const char* metaName, Func f, SavePolicy)
+// Свойство (поле) M зарегистрированного типа T. Хранится в таблице свойств типа как userdata без __gc.
+// Поля зарегистрированных типов передаются заимствованными указателями: obj.pos.x = 1 меняет сам объект.
+// Окружение такого userdata ссылается на владельца, поэтому владелец не будет собран, пока жив указатель на поле
+template <class T, class M, class ConvertTList>
+struct LuaProperty : TypeManagerDetail::PropertyHeader
+{
+	M T::* member;
+	const LuaTypesManager<ConvertTList>* conv;
+
+	// Lua Stack +1 udata
+	static inline void push(lua_State* L, M T::* member, const LuaTypesManager<ConvertTList>* conv)
 	{
-		if (std::strcmp(metaName, "__gc") == 0 || std::strcmp(metaName, "__index") == 0)
-			return *this;
-		// Таблица уже должна быть создана, выходим если не так
-		lua_pushstring(m_state, typeName);
-		lua_rawget(m_state, LUA_REGISTRYINDEX);
-		if (lua_istable(m_state, -1))
+		LuaProperty* prop = new (lua_newuserdata(L, sizeof (LuaProperty))) LuaProperty; // Lua Stack +1 udata
+		prop->get = & LuaProperty::getValue;
+		prop->set = setter(typename boost::is_const<M>::type());
+		prop->member = member;
+		prop->conv = conv;
+	}
+
+	static int getValue(lua_State* L, const TypeManagerDetail::PropertyHeader* header)
+	{
+		const LuaProperty* prop = static_cast<const LuaProperty*> (header);
+		try
 		{
-			lua_pushstring(m_state, metaName);
-			new (TypeManagerDetail::allocateLuaSpace<LuaFuncCaller > (m_state, "LuaFuncCaller", false))
-				LuaFuncCaller(m_state, f, m_conv, SavePolicy());
-			lua_pushcclosure(m_state, & LuaEngine<Convertor>::cfuncCaller, 1);
-			lua_rawset(m_state, -3);
+			const TypeManagerDetail::StackImplBase::HolderHeader* holder =
+				reinterpret_cast<const TypeManagerDetail::StackImplBase::HolderHeader*> (lua_touserdata(L, 1));
+			if (holder && (holder->flags & TypeManagerDetail::StackImplBase::HolderHeader::isConst))
+				prop->conv->pushToStack(L, &(prop->conv->template getSelf<const T>(L, 1)->*prop->member), BorrowedPointerPolicy());
+			else
+				prop->conv->pushToStack(L, &(prop->conv->template getSelf<T>(L, 1)->*prop->member), BorrowedPointerPolicy());
+			anchorOwner(L, typename LuaTypesManager<ConvertTList>::template hasType<typename boost::remove_cv<M>::type>::type());
+			return 1;
 		}
-		lua_pop(m_state, 1);
-		return *this;
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
 	}
 
-	template <class Func>
-	inline LuaEngine<Convertor>& regFunc(const char* name, Func f)
+	static int setValue(lua_State* L, const TypeManagerDetail::PropertyHeader* header)
 	{
-		return regFunc(name, f, StdPointerPolicy());
+		const LuaProperty* prop = static_cast<const LuaProperty*> (header);
+		try
+		{
+			prop->conv->template getSelf<T>(L, 1)->*prop->member = prop->conv->template getFromStack<M>(L, 3);
+			return 0;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
 	}
 
-	template <class Func>
-	inline LuaEngine<Convertor>& regMeta(const char* typeName, const char* metaName, Func f)
+private:
+	// Lua Stack +1 udata, окружение udata - таблица с владельцем (self)
+	static inline void anchorOwner(lua_State* L, mpl::true_)
+	{
+		lua_createtable(L, 1, 0); // Lua Stack +2 udata env
+		lua_pushvalue(L, 1); // Lua Stack +3 udata env self
+		lua_rawseti(L, -2, 1); // Lua Stack +2 udata env
+		lua_setfenv(L, -2); // Lua Stack +1 udata
+	}
+	static inline void anchorOwner(lua_State*, mpl::false_)
 	{
-		return regMeta(typeName, metaName, f, StdPointerPolicy());
 	}
 
-	template <class T>
-	inline LuaEngine<typename Convertor::template AddedType<T>::type>
-		regType(const std::string& name)
+	static inline int (*setter(mpl::false_)) (lua_State*, const TypeManagerDetail::PropertyHeader*)
 	{
-		return LuaEngine<typename Convertor::template AddedType<T>::type > (m_state, m_conv->template registerType<T> (name, m_state));
+		return & LuaProperty::setValue;
+	}
+	static inline int (*setter(mpl::true_)) (lua_State*, const TypeManagerDetail::PropertyHeader*)
+	{
+		return 0;
 	}
+};
 
-	template <class T>
-	inline LuaEngine<Convertor>& regVar(const char* name, T& var)
+// Метаметоды и методы LuaArrayView<T>. Upvalue 1 - конвертер, upvalue 2 у __index - таблица методов.
+// Элементы зарегистрированных типов передаются в Lua заимствованными указателями
+template <class T, class ConvertTList>
+struct LuaArrayViewFuncs
+{
+	typedef LuaTypesManager<ConvertTList> Convertor;
+
+	// Lua Stack +1 meta
+	static void pushMetatable(lua_State* L, const Convertor* conv)
 	{
-		m_conv->pushToStack(m_state, var);
-		lua_setglobal(m_state, name);
-		return *this;
+		luaL_newmetatable(L, TypeManagerDetail::arrayViewName<T>()); // Lua Stack +1 meta
+		lua_newtable(L); // Lua Stack +2 meta methods
+		pushMethod(L, conv, & LuaArrayViewFuncs::fill); // Lua Stack +3 meta methods func
+		lua_setfield(L, -2, "fill"); // Lua Stack +2 meta methods
+		pushMethod(L, conv, & LuaArrayViewFuncs::copy);
+		lua_setfield(L, -2, "copy");
+		pushMethod(L, conv, & LuaArrayViewFuncs::map);
+		lua_setfield(L, -2, "map");
+		lua_pushlightuserdata(L, const_cast<Convertor*> (conv)); // Lua Stack +3 meta methods conv
+		lua_insert(L, -2); // Lua Stack +3 meta conv methods
+		lua_pushcclosure(L, & LuaArrayViewFuncs::index, 2); // Lua Stack +2 meta func
+		lua_setfield(L, -2, "__index"); // Lua Stack +1 meta
+		pushMethod(L, conv, & LuaArrayViewFuncs::newindex);
+		lua_setfield(L, -2, "__newindex");
+		pushMethod(L, conv, & LuaArrayViewFuncs::len);
+		lua_setfield(L, -2, "__len");
 	}
+
 private:
-	typename Convertor::pointer m_conv;
-	lua_State* m_state;
+	static inline void pushMethod(lua_State* L, const Convertor* conv, lua_CFunction f)
+	{
+		lua_pushlightuserdata(L, const_cast<Convertor*> (conv));
+		lua_pushcclosure(L, f, 1);
+	}
+
+	static inline const Convertor* conv(lua_State* L)
+	{
+		return reinterpret_cast<const Convertor*> (lua_touserdata(L, lua_upvalueindex(1)));
+	}
+
+	// Индекс Lua (с 1) в индекс C++, size() если вне границ
+	static inline std::size_t toIndex(lua_State* L, int ind, const LuaArrayView<T>& view)
+	{
+		lua_Integer i = lua_tointeger(L, ind);
+		return (i >= 1 && static_cast<std::size_t> (i) <= view.size()) ? static_cast<std::size_t> (i - 1) : view.size();
+	}
 
-	static int cfuncCaller(lua_State* L)
+	static int index(lua_State* L)
 	{
-		LuaFuncCaller* funcCaller = reinterpret_cast<LuaFuncCaller*> (lua_touserdata(L, lua_upvalueindex(1)));
 		try
 		{
-			return (*funcCaller)();
-		} 
+			if (lua_type(L, 2) != LUA_TNUMBER)
+			{
+				lua_pushvalue(L, 2);
+				lua_rawget(L, lua_upvalueindex(2)); // method or nil
+				return 1;
+			}
+			LuaArrayView<T> view = conv(L)->template getFromStack<LuaArrayView<T> >(L, 1);
+			std::size_t i = toIndex(L, 2, view);
+			if (i == view.size())
+				lua_pushnil(L);
+			else
+				conv(L)->pushToStack(L, view[i], BorrowedPointerPolicy());
+			return 1;
+		}
 		catch (LuaException& e)
 		{
-			luaL_error(L, "%s", e.what.c_str());
+			TypeManagerDetail::pushErrorMessage(L, e);
 		}
-		return 0;
+		return lua_error(L);
 	}
-};
 
-inline void execLuaString(lua_State *m_state, const char *str)
-{
-	if (luaL_loadstring(m_state, str) != 0)
+	static int newindex(lua_State* L)
 	{
-		LuaSyntaxError err(lua_tostring(m_state, -1));
-		lua_pop(m_state, 1);
-		throw err;
+		try
+		{
+			LuaArrayView<T> view = conv(L)->template getFromStack<LuaArrayView<T> >(L, 1);
+			std::size_t i = toIndex(L, 2, view);
+			if (i == view.size())
+				throw LuaException("Array view index out of range");
+			view[i] = conv(L)->template getFromStack<T>(L, 3);
+			return 0;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
 	}
-	if (lua_pcall(m_state, 0, LUA_MULTRET, 0) != 0)
+
+	static int len(lua_State* L)
 	{
-		LuaRuntimeError err(lua_tostring(m_state, -1));
-		lua_pop(m_state, 1);
-		throw err;
+		try
+		{
+			lua_pushinteger(L, static_cast<lua_Integer> (conv(L)->template getFromStack<LuaArrayView<T> >(L, 1).size()));
+			return 1;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
 	}
-}
+
+	// a:fill(value)
+	static int fill(lua_State* L)
+	{
+		try
+		{
+			LuaArrayView<T> view = conv(L)->template getFromStack<LuaArrayView<T> >(L, 1);
+			const T& value = conv(L)->template getFromStack<T>(L, 2);
+			std::fill(view.data(), view.data() + view.size(), value);
+			return 0;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
+	}
+
+	// a:copy(src [, dstStart [, srcStart [, count]]]), возвращает число скопированных элементов
+	static int copy(lua_State* L)
+	{
+		try
+		{
+			LuaArrayView<T> dst = conv(L)->template getFromStack<LuaArrayView<T> >(L, 1);
+			LuaArrayView<T> src = conv(L)->template getFromStack<LuaArrayView<T> >(L, 2);
+			std::size_t dstStart = lua_isnoneornil(L, 3) ? 0 : static_cast<std::size_t> (std::max<lua_Integer>(lua_tointeger(L, 3) - 1, 0));
+			std::size_t srcStart = lua_isnoneornil(L, 4) ? 0 : static_cast<std::size_t> (std::max<lua_Integer>(lua_tointeger(L, 4) - 1, 0));
+			std::size_t count = 0;
+			if (dstStart < dst.size() && srcStart < src.size())
+				count = std::min(dst.size() - dstStart, src.size() - srcStart);
+			if (!lua_isnoneornil(L, 5))
+				count = std::min(count, static_cast<std::size_t> (std::max<lua_Integer>(lua_tointeger(L, 5), 0)));
+			if (count)
+			{
+				T* from = src.data() + srcStart;
+				T* to = dst.data() + dstStart;
+				// Представления могут ссылаться на один буфер
+				if (to <= from || to >= from + count)
+					std::copy(from, from + count, to);
+				else
+					std::copy_backward(from, from + count, to + count);
+			}
+			lua_pushinteger(L, static_cast<lua_Integer> (count));
+			return 1;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
+	}
+
+	// a:map(func): a[i] = func(a[i], i) для каждого элемента, nil оставляет элемент без изменений
+	static int map(lua_State* L)
+	{
+		try
+		{
+			LuaArrayView<T> view = conv(L)->template getFromStack<LuaArrayView<T> >(L, 1);
+			luaL_checktype(L, 2, LUA_TFUNCTION);
+			for (std::size_t i = 0; i < view.size(); ++i)
+			{
+				lua_pushvalue(L, 2); // Lua Stack +1 func
+				conv(L)->pushToStack(L, view[i], BorrowedPointerPolicy()); // Lua Stack +2 func elem
+				lua_pushinteger(L, static_cast<lua_Integer> (i + 1)); // Lua Stack +3 func elem i
+				lua_call(L, 2, 1); // Lua Stack +1 result
+				// Функция могла изменить размер вектора
+				if (!lua_isnil(L, -1) && i < view.size())
+					view[i] = conv(L)->template getFromStack<T>(L, lua_gettop(L));
+				lua_pop(L, 1); // Lua Stack 0
+			}
+			return 0;
+		}
+		catch (LuaException& e)
+		{
+			TypeManagerDetail::pushErrorMessage(L, e);
+		}
+		return lua_error(L);
+	}
+};
+
+// Вызов функций Lua из C++.
+// Функция закрепляется в реестре при создании, поэтому вызов не ищет глобальных имен и не разбирает строк.
+// Обработчик ошибок также создается один раз и хранится в реестре
+class LuaFunctionBase
+{
+public:
+	inline bool valid() const
+	{
+		return m_funcRef != LUA_NOREF && m_funcRef != LUA_REFNIL;
+	}
+
+	inline lua_State* state() const
+	{
+		return m_state;
+	}
+
+protected:
+	// Закрепляет значение с индексом idx
+	LuaFunctionBase(lua_State* L, int idx) : m_state(L)
+	{
+		lua_pushvalue(L, idx); // Lua Stack +1 func
+		m_funcRef = luaL_ref(L, LUA_REGISTRYINDEX); // Lua Stack 0
+		m_handlerRef = refHandler(L);
+	}
+
+	// Разрешает путь вида "a.b.c" от глобальной таблицы один раз, при создании
+	LuaFunctionBase(lua_State* L, const char* path) : m_state(L)
+	{
+		TypeManagerDetail::StackGuard guard(L);
+		lua_pushvalue(L, LUA_GLOBALSINDEX); // Lua Stack +1 table
+		const char* name = path;
+		for (const char* end = std::strchr(name, '.'); ; end = std::strchr(name, '.'))
+		{
+			if (!lua_istable(L, -1))
+				throw LuaException(std::string("Cannot resolve Lua function ") + path);
+			if (end)
+				lua_pushlstring(L, name, end - name);
+			else
+				lua_pushstring(L, name);
+			lua_gettable(L, -2); // Lua Stack +2 table value
+			lua_remove(L, -2); // Lua Stack +1 value
+			if (!end)
+				break;
+			name = end + 1;
+		}
+		if (lua_isnil(L, -1))
+			throw LuaException(std::string("Cannot resolve Lua function ") + path);
+		m_funcRef = luaL_ref(L, LUA_REGISTRYINDEX); // Lua Stack 0
+		m_handlerRef = refHandler(L);
+	}
+
+	LuaFunctionBase(const LuaFunctionBase& r) : m_state(r.m_state)
+	{
+		m_funcRef = copyRef(r.m_funcRef);
+		m_handlerRef = copyRef(r.m_handlerRef);
+	}
+
+	LuaFunctionBase& operator =(const LuaFunctionBase& r)
+	{
+		if (this != &r)
+		{
+			release();
+			m_state = r.m_state;
+			m_funcRef = copyRef(r.m_funcRef);
+			m_handlerRef = copyRef(r.m_handlerRef);
+		}
+		return *this;
+	}
+
+	~LuaFunctionBase()
+	{
+		release();
+	}
+
+	// Lua Stack +2 handler func, возвращает индекс обработчика ошибок
+	inline int prepareCall() const
+	{
+		lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_handlerRef); // Lua Stack +1 handler
+		lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_funcRef); // Lua Stack +2 handler func
+		return lua_gettop(m_state) - 1;
+	}
+
+	// Lua Stack: handler func args -> handler results
+	inline void doCall(int handler, int nargs, int nresults) const
+	{
+		if (lua_pcall(m_state, nargs, nresults, handler) != 0)
+			TypeManagerDetail::throwCallError(m_state);
+	}
+
+	lua_State* m_state;
+	int m_funcRef;
+	int m_handlerRef;
+
+private:
+	inline int copyRef(int ref) const
+	{
+		lua_rawgeti(m_state, LUA_REGISTRYINDEX, ref); // Lua Stack +1 value
+		return luaL_ref(m_state, LUA_REGISTRYINDEX); // Lua Stack 0
+	}
+
+	inline void release()
+	{
+		luaL_unref(m_state, LUA_REGISTRYINDEX, m_funcRef);
+		luaL_unref(m_state, LUA_REGISTRYINDEX, m_handlerRef);
+	}
+
+	static int refHandler(lua_State* L)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, "LUABINDER_ErrHandler"); // Lua Stack +1 handler|nil
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1); // Lua Stack 0
+			lua_pushcfunction(L, & LuaFunctionBase::errorHandler); // Lua Stack +1 handler
+			lua_pushvalue(L, -1); // Lua Stack +2 handler handler
+			lua_setfield(L, LUA_REGISTRYINDEX, "LUABINDER_ErrHandler"); // Lua Stack +1 handler
+		}
+		return luaL_ref(L, LUA_REGISTRYINDEX); // Lua Stack 0
+	}
+
+	// Добавляет к сообщению об ошибке стек вызовов, если доступна библиотека debug
+	static int errorHandler(lua_State* L)
+	{
+		lua_getfield(L, LUA_GLOBALSINDEX, "debug"); // Lua Stack msg debug
+		if (lua_istable(L, -1))
+		{
+			lua_getfield(L, -1, "traceback"); // Lua Stack msg debug traceback
+			if (lua_isfunction(L, -1))
+			{
+				lua_pushvalue(L, 1); // Lua Stack msg debug traceback msg
+				lua_pushinteger(L, 2); // Lua Stack msg debug traceback msg 2
+				lua_call(L, 2, 1); // Lua Stack msg debug trace
+				return 1;
+			}
+		}
+		lua_settop(L, 1); // Lua Stack msg
+		return 1;
+	}
+};
+
+// Результат снимается со стека при выходе из operator(), поэтому возвращаются только владеющие типы:
+// значения, std::string, контейнеры. Указатели и ссылки (в том числе const char* и на объекты в userdata)
+// и LuaStringRef указывали бы в память Lua, которую сборщик может освободить сразу после вызова
+template <class R> struct LuaFunctionResult
+{
+	enum { count = 1 };
+	BOOST_STATIC_ASSERT(!boost::is_pointer<R>::value);
+	BOOST_STATIC_ASSERT(!boost::is_reference<R>::value);
+	BOOST_STATIC_ASSERT((!boost::is_same<typename boost::remove_cv<R>::type, LuaStringRef>::value));
+
+	template <class Convertor>
+	static inline R get(lua_State* L, const Convertor& conv)
+	{
+		return conv.template getFromStack<R>(L, lua_gettop(L));
+	}
+};
+
+template <> struct LuaFunctionResult<void>
+{
+	enum { count = 0 };
+
+	template <class Convertor>
+	static inline void get(lua_State*, const Convertor&) {}
+};
+
+template <class Signature, class Convertor = LTypesManager> class LuaFunction;
+
+#	define LUABINDER_PUSH_ARG(z, n, unused) m_conv->pushToStack(this->m_state, a##n);
+#	define LUABINDER_LUAFUNCTION_ITEM(z, n, unused) \
+	template <class R BOOST_PP_ENUM_TRAILING_PARAMS_Z(z, n, class A), class Convertor> \
+	class LuaFunction<R (BOOST_PP_ENUM_PARAMS_Z(z, n, A)), Convertor> : public LuaFunctionBase \
+	{ \
+	public: \
+		LuaFunction(lua_State* L, const typename Convertor::pointer& conv, const char* path) : \
+			LuaFunctionBase(L, path), m_conv(conv) {} \
+		LuaFunction(lua_State* L, const typename Convertor::pointer& conv, int idx) : \
+			LuaFunctionBase(L, idx), m_conv(conv) {} \
+		\
+		R operator() (BOOST_PP_ENUM_BINARY_PARAMS_Z(z, n, A, a)) const \
+		{ \
+			TypeManagerDetail::StackGuard guard(this->m_state); \
+			int handler = prepareCall(); \
+			BOOST_PP_REPEAT_ ## z(n, LUABINDER_PUSH_ARG, ~) \
+			doCall(handler, n, LuaFunctionResult<R>::count); \
+			return LuaFunctionResult<R>::get(this->m_state, *m_conv); \
+		} \
+	private: \
+		typename Convertor::pointer m_conv; \
+	};
+
+BOOST_PP_REPEAT(BOOST_PP_INC(LUABINDER_MAX_ARITY), LUABINDER_LUAFUNCTION_ITEM, ~)
+#	undef LUABINDER_LUAFUNCTION_ITEM
+#	undef LUABINDER_PUSH_ARG
+
+template <class Convertor = LTypesManager>
+class LuaEngine
+{
+public:
+	LuaEngine(lua_State* state)
+	{
+		m_conv = typename Convertor::pointer(new Convertor);
+		m_state = state;
+	}
+	LuaEngine(lua_State* state, const typename Convertor::pointer& p) :m_conv(p), m_state(state) {}
+
+	~LuaEngine() {}
+
+	template <class SavePolicy, class Func>
+	inline LuaEngine<Convertor>& regFunc(const char* name, Func f, SavePolicy)
+	{
+		LUABINDER_PROFILE_RECORD(m_state, name)
+		pushCaller(f, SavePolicy()); // Lua Stack +1 closure
+		lua_setfield(m_state, LUA_GLOBALSINDEX, name);
+		return *this;
+	}
+
+	// Несколько сигнатур под одним именем: regOverload("add", &addInt).regOverload("add", &addVec).
+	// Сигнатура выбирается по числу аргументов, а среди сигнатур одной длины - по типам Lua аргументов,
+	// в порядке регистрации. regFunc с тем же именем заменяет все перегрузки
+	template <class SavePolicy, class Func>
+	inline LuaEngine<Convertor>& regOverload(const char* name, Func f, SavePolicy)
+	{
+		anchorConvertor();
+		TypeManagerDetail::OverloadSet* set = 0;
+		lua_getfield(m_state, LUA_GLOBALSINDEX, name); // Lua Stack +1 value
+		if (lua_tocfunction(m_state, -1) == & TypeManagerDetail::callOverload && lua_getupvalue(m_state, -1, 1)) // Lua Stack +2 value set
+		{
+			set = reinterpret_cast<TypeManagerDetail::OverloadSet*> (lua_touserdata(m_state, -1));
+			lua_pop(m_state, 2); // Lua Stack 0
+		}
+		else
+		{
+			lua_pop(m_state, 1); // Lua Stack 0
+			set = new (TypeManagerDetail::allocateLuaSpace<TypeManagerDetail::OverloadSet > (m_state, "LUABINDER_OverloadSet", false))
+				TypeManagerDetail::OverloadSet; // Lua Stack +1 set
+			set->name = name;
+#ifdef LUABINDER_PROFILE
+			TypeManagerDetail::pushProfileRecord(m_state, name); // Lua Stack +2 set record
+			set->stats = reinterpret_cast<LuaBindingStats*> (lua_touserdata(m_state, -1));
+			lua_pop(m_state, 1); // Lua Stack +1 set
+#endif
+			lua_pushcclosure(m_state, & TypeManagerDetail::callOverload, 1); // Lua Stack +1 closure
+			lua_setfield(m_state, LUA_GLOBALSINDEX, name); // Lua Stack 0
+		}
+		set->add(new LuaOverload<SavePolicy, Func, typename Convertor::tlist>(f, m_conv.get()));
+		return *this;
+	}
+
+	template <class Func>
+	inline LuaEngine<Convertor>& regOverload(const char* name, Func f)
+	{
+		return regOverload(name, f, StdPointerPolicy());
+	}
+
+	template <class SavePolicy, class Func>
+	inline LuaEngine<Convertor>& regMeta(const char* typeName, const char* metaName, Func f, SavePolicy)
+	{
+		if (std::strcmp(metaName, "__gc") == 0 || std::strcmp(metaName, "__index") == 0)
+			return *this;
+		// Тип уже должен быть зарегистрирован, выходим если не так
+		if (m_conv->pushMetatable(m_state, typeName)) // Lua Stack +1 meta
+		{
+			lua_pushstring(m_state, metaName); // Lua Stack +2 meta name
+			lua_rawget(m_state, -2); // Lua Stack +2 meta previous
+			LUABINDER_PROFILE_RECORD(m_state, std::string(typeName) + "." + metaName)
+			pushCaller(f, SavePolicy()); // Lua Stack +3 meta previous func
+			lua_pushvalue(m_state, -1); // Lua Stack +4 meta previous func func
+			lua_setfield(m_state, -4, metaName); // Lua Stack +3 meta previous func
+			// Метаметоды нужны и заимствованным указателям, методы им доступны через __index
+			m_conv->pushMetatable(m_state, typeName, true); // Lua Stack +4 meta previous func bmeta
+			lua_pushvalue(m_state, -2); // Lua Stack +5 meta previous func bmeta func
+			lua_setfield(m_state, -2, metaName); // Lua Stack +4 meta previous func bmeta
+			lua_pop(m_state, 1); // Lua Stack +3 meta previous func
+			m_conv->inheritMetamethod(m_state, typeName, metaName, -2, -1); // Lua Stack +3
+			lua_pop(m_state, 3); // Lua Stack 0
+		}
+		return *this;
+	}
+
+	// Метод зарегистрированного типа: regMethod("length", &Vec::length), в Lua - v:length().
+	// Объект берется прямо из userdata первого аргумента
+	template <class SavePolicy, class Func>
+	inline LuaEngine<Convertor>& regMethod(const char* name, Func f, SavePolicy)
+	{
+		typedef typename boost::remove_cv<typename LuaFuncCaller::selfOf<Func>::type>::type T;
+		BOOST_STATIC_ASSERT(boost::is_member_function_pointer<Func>::value);
+		BOOST_STATIC_ASSERT(Convertor::template hasType<T>::value);
+		anchorConvertor();
+		m_conv->template pushTypeMetatable<T>(m_state); // Lua Stack +1 meta
+		LUABINDER_PROFILE_RECORD(m_state, m_conv->template typeName<T>() + ":" + name)
+		LuaFuncCaller::pushMethod(m_state, f, m_conv.get(), SavePolicy()); // Lua Stack +2 meta func
+		lua_setfield(m_state, -2, name); // Lua Stack +1 meta
+		lua_pop(m_state, 1); // Lua Stack 0
+		return *this;
+	}
+
+	template <class Func>
+	inline LuaEngine<Convertor>& regMethod(const char* name, Func f)
+	{
+		return regMethod(name, f, StdPointerPolicy());
+	}
+
+	// Поле зарегистрированного типа: regProperty("x", &Vec::x), в Lua - v.x и v.x = 1.
+	// Константные поля доступны только для чтения
+	template <class T, class M>
+	inline LuaEngine<Convertor>& regProperty(const char* name, M T::* member)
+	{
+		BOOST_STATIC_ASSERT(!boost::is_function<M>::value);
+		BOOST_STATIC_ASSERT(Convertor::template hasType<T>::value);
+		anchorConvertor();
+		m_conv->template pushProperties<T>(m_state); // Lua Stack +1 props
+		LuaProperty<T, M, typename Convertor::tlist>::push(m_state, member, m_conv.get()); // Lua Stack +2 props prop
+		lua_setfield(m_state, -2, name); // Lua Stack +1 props
+		lua_pop(m_state, 1); // Lua Stack 0
+		return *this;
+	}
+
+	// Регистрирует конструктор: regConstructor<Vec3 (float, float, float)>("Vec3").
+	// Объект создается прямо в userdata, Vec3(1, 2, 3) в Lua требует одного выделения памяти
+	template <class Signature>
+	inline LuaEngine<Convertor>& regConstructor(const char* name)
+	{
+		BOOST_STATIC_ASSERT((Convertor::template hasType<typename boost::function_types::result_type<Signature>::type>::value));
+		anchorConvertor();
+		LUABINDER_PROFILE_RECORD(m_state, name)
+		LuaFuncCaller::pushConstructor<Signature>(m_state, m_conv.get()); // Lua Stack +1 closure
+		lua_setfield(m_state, LUA_GLOBALSINDEX, name);
+		return *this;
+	}
+
+	template <class Func>
+	inline LuaEngine<Convertor>& regFunc(const char* name, Func f)
+	{
+		return regFunc(name, f, StdPointerPolicy());
+	}
+
+	template <class Func>
+	inline LuaEngine<Convertor>& regMeta(const char* typeName, const char* metaName, Func f)
+	{
+		return regMeta(typeName, metaName, f, StdPointerPolicy());
+	}
+
+	template <class T>
+	inline LuaEngine<typename Convertor::template AddedType<T>::type>
+		regType(const std::string& name)
+	{
+		return LuaEngine<typename Convertor::template AddedType<T>::type > (m_state, m_conv->template registerType<T> (name, m_state));
+	}
+
+	// Наследник зарегистрированного типа: regType<Derived, Base>("Derived")
+	template <class T, class Base>
+	inline LuaEngine<typename Convertor::template AddedType<T>::type>
+		regType(const std::string& name)
+	{
+		return LuaEngine<typename Convertor::template AddedType<T>::type > (m_state, m_conv->template registerType<T, Base> (name, m_state));
+	}
+
+	// Регистрирует LuaArrayView<T>, после чего представления можно передавать в Lua и из Lua
+	template <class T>
+	inline LuaEngine<Convertor>& regArray()
+	{
+		anchorConvertor();
+		LuaArrayViewFuncs<T, typename Convertor::tlist>::pushMetatable(m_state, m_conv.get()); // Lua Stack +1 meta
+		lua_pop(m_state, 1);
+		return *this;
+	}
+
+	// Возвращает закрепленную функцию Lua по пути вида "a.b.c"
+	template <class Signature>
+	inline LuaFunction<Signature, Convertor> getFunction(const char* path) const
+	{
+		return LuaFunction<Signature, Convertor>(m_state, m_conv, path);
+	}
+
+	// Должна вызываться при удалении объекта, переданного в Lua с CachedPointerPolicy
+	template <class T>
+	inline LuaEngine<Convertor>& forgetObject(const T* obj)
+	{
+		m_conv->forgetObject(m_state, obj);
+		return *this;
+	}
+
+	inline lua_State* state() const
+	{
+		return m_state;
+	}
+#ifdef LUABINDER_PROFILE
+
+	// Снимок счетчиков привязок контекста, самые затратные по суммарному времени - первыми
+	std::vector<LuaBindingStats> profile() const
+	{
+		const TypeManagerDetail::ProfileData* data = TypeManagerDetail::profileData(m_state);
+		std::vector<LuaBindingStats> result;
+		result.reserve(data->size());
+		for (TypeManagerDetail::ProfileData::const_iterator it = data->begin(); it != data->end(); ++it)
+			result.push_back(it->second);
+		std::sort(result.begin(), result.end(), & TypeManagerDetail::hotterBinding);
+		return result;
+	}
+
+	inline LuaEngine<Convertor>& resetProfile()
+	{
+		TypeManagerDetail::ProfileData* data = TypeManagerDetail::profileData(m_state);
+		for (TypeManagerDetail::ProfileData::iterator it = data->begin(); it != data->end(); ++it)
+		{
+			it->second = LuaBindingStats();
+			it->second.name = it->first;
+		}
+		return *this;
+	}
+
+	// Функция снимка счетчиков для скриптов: regProfiler("profile"), в Lua - profile()["Vec:length"].calls
+	inline LuaEngine<Convertor>& regProfiler(const char* name)
+	{
+		lua_pushcfunction(m_state, & TypeManagerDetail::profileSnapshot); // Lua Stack +1 func
+		lua_setfield(m_state, LUA_GLOBALSINDEX, name); // Lua Stack 0
+		return *this;
+	}
+#endif
+
+	template <class T>
+	inline LuaEngine<Convertor>& regVar(const char* name, T& var)
+	{
+		m_conv->pushToStack(m_state, var);
+		lua_setglobal(m_state, name);
+		return *this;
+	}
+private:
+	typename Convertor::pointer m_conv;
+	lua_State* m_state;
+
+	template <class SavePolicy, class Func>
+	inline void pushCaller(Func f, SavePolicy)
+	{
+		anchorConvertor();
+		LuaFuncCaller::push(m_state, f, m_conv.get(), SavePolicy()); // Lua Stack +1 closure
+	}
+
+	// Конвертер передается в замыкания простым указателем, поэтому его время жизни
+	// привязывается к контексту Lua: копия shared_ptr хранится в реестре до закрытия контекста
+	inline void anchorConvertor()
+	{
+		lua_pushlightuserdata(m_state, m_conv.get()); // Lua Stack +1 key
+		lua_rawget(m_state, LUA_REGISTRYINDEX); // Lua Stack +1 anchor
+		if (lua_isnil(m_state, -1))
+		{
+			lua_pop(m_state, 1); // Lua Stack 0
+			lua_pushlightuserdata(m_state, m_conv.get()); // Lua Stack +1 key
+			new (TypeManagerDetail::allocateLuaSpace<typename Convertor::pointer > (m_state, typeid (typename Convertor::pointer).name(), false))
+				typename Convertor::pointer(m_conv); // Lua Stack +2 key anchor
+			lua_rawset(m_state, LUA_REGISTRYINDEX); // Lua Stack 0
+		}
+		else
+			lua_pop(m_state, 1); // Lua Stack 0
+	}
+};
+
+namespace TypeManagerDetail
+{
+	// Конвертеры одного контекста по номерам слотов LuaRegistry
+	typedef std::vector<boost::shared_ptr<void> > ReplaySlots;
+
+	// Записанная регистрация, повторяемая в каждом новом контексте. Неизменяема после записи,
+	// поэтому один шаг могут одновременно применять несколько потоков к своим контекстам
+	struct RegistryStep : boost::noncopyable
+	{
+		virtual ~RegistryStep() {}
+		virtual void apply(lua_State* L, ReplaySlots& slots) const = 0;
+	};
+
+	struct RegistrySteps
+	{
+		std::vector<boost::shared_ptr<const RegistryStep> > list;
+		std::size_t slots;
+
+		RegistrySteps() : slots(1) {}
+	};
+}
+
+// Запись регистраций без контекста Lua: тот же интерфейс, что у LuaEngine, но вызовы только запоминаются.
+// apply(L) повторяет их в любом контексте и возвращает готовый LuaEngine, так что один реестр
+// наполняет сколько угодно независимых контекстов (см. LuaEnginePool). Каждый regType получает
+// свой слот конвертера, в контексте им соответствуют собственные MetaData и метатаблицы
+template <class Convertor = LTypesManager>
+class LuaRegistry
+{
+	template <class> friend class LuaRegistry;
+public:
+	LuaRegistry() : m_steps(new TypeManagerDetail::RegistrySteps), m_slot(0)
+	{
+		m_steps->list.push_back(boost::shared_ptr<const TypeManagerDetail::RegistryStep>(new RootStep));
+	}
+
+	template <class SavePolicy, class Func>
+	inline LuaRegistry<Convertor>& regFunc(const char* name, Func f, SavePolicy)
+	{
+		return add(FuncAction<SavePolicy, Func>(name, f));
+	}
+
+	template <class Func>
+	inline LuaRegistry<Convertor>& regFunc(const char* name, Func f)
+	{
+		return regFunc(name, f, StdPointerPolicy());
+	}
+
+	template <class SavePolicy, class Func>
+	inline LuaRegistry<Convertor>& regOverload(const char* name, Func f, SavePolicy)
+	{
+		return add(OverloadAction<SavePolicy, Func>(name, f));
+	}
+
+	template <class Func>
+	inline LuaRegistry<Convertor>& regOverload(const char* name, Func f)
+	{
+		return regOverload(name, f, StdPointerPolicy());
+	}
+
+	template <class SavePolicy, class Func>
+	inline LuaRegistry<Convertor>& regMeta(const char* typeName, const char* metaName, Func f, SavePolicy)
+	{
+		return add(MetaAction<SavePolicy, Func>(typeName, metaName, f));
+	}
+
+	template <class Func>
+	inline LuaRegistry<Convertor>& regMeta(const char* typeName, const char* metaName, Func f)
+	{
+		return regMeta(typeName, metaName, f, StdPointerPolicy());
+	}
+
+	template <class SavePolicy, class Func>
+	inline LuaRegistry<Convertor>& regMethod(const char* name, Func f, SavePolicy)
+	{
+		return add(MethodAction<SavePolicy, Func>(name, f));
+	}
+
+	template <class Func>
+	inline LuaRegistry<Convertor>& regMethod(const char* name, Func f)
+	{
+		return regMethod(name, f, StdPointerPolicy());
+	}
+
+	template <class T, class M>
+	inline LuaRegistry<Convertor>& regProperty(const char* name, M T::* member)
+	{
+		return add(PropertyAction<T, M>(name, member));
+	}
+
+	template <class Signature>
+	inline LuaRegistry<Convertor>& regConstructor(const char* name)
+	{
+		return add(ConstructorAction<Signature>(name));
+	}
+
+	template <class T>
+	inline LuaRegistry<Convertor>& regArray()
+	{
+		return add(ArrayAction<T>());
+	}
+
+	template <class T>
+	inline LuaRegistry<typename Convertor::template AddedType<T>::type>
+		regType(const std::string& name)
+	{
+		return addType<T, void>(name);
+	}
+
+	template <class T, class Base>
+	inline LuaRegistry<typename Convertor::template AddedType<T>::type>
+		regType(const std::string& name)
+	{
+		return addType<T, Base>(name);
+	}
+
+	// Повторяет все записанные регистрации в контексте L (в том числе сделанные через другие
+	// LuaRegistry той же цепочки) и возвращает LuaEngine с конвертером этого реестра
+	LuaEngine<Convertor> apply(lua_State* L) const
+	{
+		TypeManagerDetail::ReplaySlots slots(m_steps->slots);
+		for (std::size_t i = 0; i < m_steps->list.size(); ++i)
+			m_steps->list[i]->apply(L, slots);
+		return LuaEngine<Convertor>(L, boost::static_pointer_cast<Convertor>(slots[m_slot]));
+	}
+
+	// Копия записи: дальнейшие регистрации в исходный реестр на нее не влияют
+	LuaRegistry<Convertor> snapshot() const
+	{
+		return LuaRegistry<Convertor>(boost::shared_ptr<TypeManagerDetail::RegistrySteps>(
+			new TypeManagerDetail::RegistrySteps(*m_steps)), m_slot);
+	}
+
+private:
+	boost::shared_ptr<TypeManagerDetail::RegistrySteps> m_steps;
+	std::size_t m_slot;
+
+	LuaRegistry(const boost::shared_ptr<TypeManagerDetail::RegistrySteps>& steps, std::size_t slot) :
+	m_steps(steps), m_slot(slot) {}
+
+	// Корневой конвертер, слот 0
+	struct RootStep : TypeManagerDetail::RegistryStep
+	{
+		virtual void apply(lua_State*, TypeManagerDetail::ReplaySlots& slots) const
+		{
+			slots[0] = boost::shared_ptr<void>(new Convertor);
+		}
+	};
+
+	// Регистрация через LuaEngine с конвертером слота
+	template <class Action>
+	struct EngineStep : TypeManagerDetail::RegistryStep
+	{
+		std::size_t slot;
+		Action action;
+
+		EngineStep(std::size_t s, const Action& a) : slot(s), action(a) {}
+
+		virtual void apply(lua_State* L, TypeManagerDetail::ReplaySlots& slots) const
+		{
+			LuaEngine<Convertor> engine(L, boost::static_pointer_cast<Convertor>(slots[slot]));
+			action(engine);
+		}
+	};
+
+	template <class T, class Base>
+	struct TypeStep : TypeManagerDetail::RegistryStep
+	{
+		std::size_t slot, added;
+		std::string name;
+
+		TypeStep(std::size_t s, std::size_t a, const std::string& n) : slot(s), added(a), name(n) {}
+
+		virtual void apply(lua_State* L, TypeManagerDetail::ReplaySlots& slots) const
+		{
+			slots[added] = registerType(*boost::static_pointer_cast<Convertor>(slots[slot]), L, Type2Type<Base>());
+		}
+
+		template <class B>
+		inline typename Convertor::template AddedType<T>::type::pointer
+			registerType(Convertor& conv, lua_State* L, Type2Type<B>) const
+		{
+			return conv.template registerType<T, B>(name, L);
+		}
+		inline typename Convertor::template AddedType<T>::type::pointer
+			registerType(Convertor& conv, lua_State* L, Type2Type<void>) const
+		{
+			return conv.template registerType<T>(name, L);
+		}
+	};
+
+	template <class SavePolicy, class Func>
+	struct FuncAction
+	{
+		std::string name;
+		Func f;
+
+		FuncAction(const char* n, Func func) : name(n), f(func) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.regFunc(name.c_str(), f, SavePolicy()); }
+	};
+
+	template <class SavePolicy, class Func>
+	struct OverloadAction
+	{
+		std::string name;
+		Func f;
+
+		OverloadAction(const char* n, Func func) : name(n), f(func) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.regOverload(name.c_str(), f, SavePolicy()); }
+	};
+
+	template <class SavePolicy, class Func>
+	struct MetaAction
+	{
+		std::string typeName, metaName;
+		Func f;
+
+		MetaAction(const char* t, const char* m, Func func) : typeName(t), metaName(m), f(func) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.regMeta(typeName.c_str(), metaName.c_str(), f, SavePolicy()); }
+	};
+
+	template <class SavePolicy, class Func>
+	struct MethodAction
+	{
+		std::string name;
+		Func f;
+
+		MethodAction(const char* n, Func func) : name(n), f(func) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.regMethod(name.c_str(), f, SavePolicy()); }
+	};
+
+	template <class T, class M>
+	struct PropertyAction
+	{
+		std::string name;
+		M T::* member;
+
+		PropertyAction(const char* n, M T::* m) : name(n), member(m) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.regProperty(name.c_str(), member); }
+	};
+
+	template <class Signature>
+	struct ConstructorAction
+	{
+		std::string name;
+
+		ConstructorAction(const char* n) : name(n) {}
+		void operator()(LuaEngine<Convertor>& e) const { e.template regConstructor<Signature>(name.c_str()); }
+	};
+
+	template <class T>
+	struct ArrayAction
+	{
+		void operator()(LuaEngine<Convertor>& e) const { e.template regArray<T>(); }
+	};
+
+	template <class Action>
+	inline LuaRegistry<Convertor>& add(const Action& action)
+	{
+		m_steps->list.push_back(boost::shared_ptr<const TypeManagerDetail::RegistryStep>(new EngineStep<Action>(m_slot, action)));
+		return *this;
+	}
+
+	template <class T, class Base>
+	inline LuaRegistry<typename Convertor::template AddedType<T>::type> addType(const std::string& name)
+	{
+		std::size_t added = m_steps->slots++;
+		m_steps->list.push_back(boost::shared_ptr<const TypeManagerDetail::RegistryStep>(new TypeStep<T, Base>(m_slot, added, name)));
+		return LuaRegistry<typename Convertor::template AddedType<T>::type>(m_steps, added);
+	}
+};
+
+#ifdef LUABINDER_ENGINE_POOL
+// Пул независимых контекстов Lua, по одному на рабочий поток. Контексты наполняются одним
+// LuaRegistry (его копией на момент создания пула), задания распределяются по очередям потоков
+// по кругу, освободившийся поток забирает задания с конца чужих очередей.
+// Задание получает LuaEngine своего потока и выполняется только в нем
+template <class Convertor = LTypesManager>
+class LuaEnginePool : public boost::noncopyable
+{
+public:
+	typedef boost::function<void (LuaEngine<Convertor>&)> Job;
+	typedef lua_State* (*StateFactory)();
+
+	explicit LuaEnginePool(const LuaRegistry<Convertor>& registry, std::size_t workers = 0,
+		StateFactory factory = & LuaEnginePool::newState) :
+	m_registry(registry.snapshot()), m_factory(factory), m_next(0), m_queued(0), m_pending(0), m_stopping(false)
+	{
+		if (workers == 0)
+			workers = std::max(1u, boost::thread::hardware_concurrency());
+		for (std::size_t i = 0; i < workers; ++i)
+			m_workers.push_back(boost::shared_ptr<Worker>(new Worker));
+		for (std::size_t i = 0; i < workers; ++i)
+			m_workers[i]->thread = boost::thread(& LuaEnginePool::run, this, i);
+	}
+
+	// Дожидается уже поставленных заданий и закрывает контексты
+	~LuaEnginePool()
+	{
+		{
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+		for (std::size_t i = 0; i < m_workers.size(); ++i)
+			m_workers[i]->thread.join();
+	}
+
+	inline void submit(const Job& job)
+	{
+		std::size_t target;
+		// Счетчики растут до появления задания в очереди: поток, взявший задание сразу после вставки,
+		// уменьшает m_queued, и тот не должен уйти ниже нуля
+		{
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			target = m_next++ % m_workers.size();
+			++m_pending;
+			++m_queued;
+		}
+		{
+			boost::unique_lock<boost::mutex> lock(m_workers[target]->mutex);
+			m_workers[target]->jobs.push_back(job);
+		}
+		m_wake.notify_one();
+	}
+
+	// Ждет завершения всех поставленных заданий. Если задания бросали исключения или контекст потока
+	// не удалось наполнить, бросает LuaRuntimeError с текстом первой ошибки
+	void wait()
+	{
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while (m_pending != 0)
+			m_idle.wait(lock);
+		if (!m_errors.empty())
+		{
+			LuaRuntimeError err(m_errors.front());
+			m_errors.clear();
+			throw err;
+		}
+	}
+
+	inline std::size_t size() const
+	{
+		return m_workers.size();
+	}
+
+	static lua_State* newState()
+	{
+		lua_State* L = luaL_newstate();
+		luaL_openlibs(L);
+		return L;
+	}
+
+private:
+	struct Worker
+	{
+		boost::thread thread;
+		boost::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	LuaRegistry<Convertor> m_registry;
+	StateFactory m_factory;
+	std::vector<boost::shared_ptr<Worker> > m_workers;
+
+	// Защищает счетчики и список ошибок
+	boost::mutex m_mutex;
+	boost::condition_variable m_wake;
+	boost::condition_variable m_idle;
+	std::size_t m_next;
+	// Заданий в очередях и заданий, еще не завершенных (в очередях и выполняемых)
+	std::size_t m_queued;
+	std::size_t m_pending;
+	bool m_stopping;
+	std::vector<std::string> m_errors;
+
+	// Свое задание берется с начала очереди, чужое - с конца
+	bool take(std::size_t self, Job& job)
+	{
+		for (std::size_t i = 0; i < m_workers.size(); ++i)
+		{
+			Worker& victim = *m_workers[(self + i) % m_workers.size()];
+			boost::unique_lock<boost::mutex> lock(victim.mutex);
+			if (victim.jobs.empty())
+				continue;
+			if (i == 0)
+			{
+				job.swap(victim.jobs.front());
+				victim.jobs.pop_front();
+			}
+			else
+			{
+				job.swap(victim.jobs.back());
+				victim.jobs.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Если контекст не удалось создать или наполнить, поток не выполняет задания, а завершает их с ошибкой
+	// установки: иначе m_pending не дошел бы до нуля и wait() ждал бы вечно
+	void run(std::size_t self)
+	{
+		lua_State* L = m_factory();
+		boost::shared_ptr<LuaEngine<Convertor> > engine;
+		std::string setupError = "cannot create Lua state";
+		if (L)
+		{
+			try
+			{
+				engine.reset(new LuaEngine<Convertor>(m_registry.apply(L)));
+			}
+			catch (LuaException& e)
+			{
+				setupError = e.what;
+			}
+			catch (std::exception& e)
+			{
+				setupError = e.what();
+			}
+			catch (...)
+			{
+				setupError = "unknown exception";
+			}
+		}
+		for (;;)
+		{
+			Job job;
+			if (!take(self, job))
+			{
+				boost::unique_lock<boost::mutex> lock(m_mutex);
+				while (m_queued == 0 && !m_stopping)
+					m_wake.wait(lock);
+				if (m_queued == 0)
+					break;
+				continue;
+			}
+			{
+				boost::unique_lock<boost::mutex> lock(m_mutex);
+				--m_queued;
+			}
+			std::string error;
+			bool failed = true;
+			if (!engine)
+				error = "Lua engine setup failed: " + setupError;
+			else
+			{
+				try
+				{
+					job(*engine);
+					failed = false;
+				}
+				catch (LuaException& e)
+				{
+					error = e.what;
+				}
+				catch (std::exception& e)
+				{
+					error = e.what();
+				}
+				catch (...)
+				{
+					error = "unknown exception";
+				}
+				lua_settop(L, 0);
+			}
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			if (failed)
+				m_errors.push_back(error);
+			if (--m_pending == 0)
+				m_idle.notify_all();
+		}
+		// Движок держит конвертер, который должен быть разрушен до lua_close
+		engine.reset();
+		if (L)
+			lua_close(L);
+	}
+};
+#endif
+
+// Сторож выполнения скриптов контекста: бюджет инструкций Lua и времени для контекста в целом
+// (setStateBudget) и для отдельного вызова (Scope). При превышении скрипт прерывается ошибкой Lua,
+// execLuaString, LuaChunkCache::exec и LuaFunction бросают LuaBudgetError.
+// Счетный хук ставится, только пока задан хотя бы один бюджет, без бюджетов накладных расходов нет.
+// Пределы проверяются раз в interval инструкций; долгий код C++ внутри привязанной функции не прерывается.
+// Сопрограммы получают хук при возобновлении: coroutine.resume и coroutine.wrap заменяются обертками,
+// поэтому сторож создается после открытия библиотек. Потоки, возобновляемые из C++ через lua_resume, не охраняются.
+// У контекста может быть только один сторож. Сторож занимает хук контекста (lua_sethook)
+// и, как LuaChunkCache, разрушается до lua_close
+class LuaWatchdog : public boost::noncopyable
+{
+public:
+	explicit LuaWatchdog(lua_State* L, int interval = 1000) : m_state(L)
+	{
+		if (TypeManagerDetail::watchdogData(L))
+			throw LuaException("LuaWatchdog: the Lua state already has a watchdog");
+		m_data.interval = std::max(1, interval);
+		m_data.executed = 0;
+		m_data.stateInstructions = m_data.stateDeadline = unlimited();
+		m_data.callInstructions = m_data.callDeadline = unlimited();
+		m_data.active = false;
+		m_data.tripped = false;
+		lua_pushlightuserdata(L, &m_data); // Lua Stack +1 data
+		lua_setfield(L, LUA_REGISTRYINDEX, "LUABINDER_Watchdog"); // Lua Stack 0
+		TypeManagerDetail::wrapCoroutineLib(L);
+	}
+
+	~LuaWatchdog()
+	{
+		removeHook();
+		lua_pushnil(m_state); // Lua Stack +1 nil
+		lua_setfield(m_state, LUA_REGISTRYINDEX, "LUABINDER_Watchdog"); // Lua Stack 0
+	}
+
+	// Бюджет контекста начиная с текущего момента: инструкций и наносекунд, 0 - без предела
+	inline void setStateBudget(boost::uint64_t instructions, boost::uint64_t nanos)
+	{
+		m_data.stateInstructions = limit(m_data.executed, instructions);
+		m_data.stateDeadline = limit(TypeManagerDetail::monotonicNanos(), nanos);
+		update();
+	}
+
+	inline void clearStateBudget()
+	{
+		setStateBudget(0, 0);
+	}
+
+	// Примерное число выполненных инструкций под бюджетами (с точностью до interval)
+	inline boost::uint64_t executed() const
+	{
+		return m_data.executed;
+	}
+
+	// Бюджет на время жизни объекта, обычно один вызов execLuaString или LuaFunction.
+	// Вложенный Scope не может расширить внешний
+	class Scope : public boost::noncopyable
+	{
+	public:
+		Scope(LuaWatchdog& watchdog, boost::uint64_t instructions, boost::uint64_t nanos) :
+		m_watchdog(watchdog), m_instructions(watchdog.m_data.callInstructions), m_deadline(watchdog.m_data.callDeadline)
+		{
+			TypeManagerDetail::WatchdogData& data = watchdog.m_data;
+			data.callInstructions = std::min(m_instructions, limit(data.executed, instructions));
+			data.callDeadline = std::min(m_deadline, limit(TypeManagerDetail::monotonicNanos(), nanos));
+			watchdog.update();
+		}
+
+		~Scope()
+		{
+			m_watchdog.m_data.callInstructions = m_instructions;
+			m_watchdog.m_data.callDeadline = m_deadline;
+			m_watchdog.update();
+		}
+
+	private:
+		LuaWatchdog& m_watchdog;
+		boost::uint64_t m_instructions;
+		boost::uint64_t m_deadline;
+	};
+
+private:
+	lua_State* m_state;
+	TypeManagerDetail::WatchdogData m_data;
+
+	static inline boost::uint64_t unlimited()
+	{
+		return std::numeric_limits<boost::uint64_t>::max();
+	}
+
+	static inline boost::uint64_t limit(boost::uint64_t from, boost::uint64_t amount)
+	{
+		return amount ? from + amount : unlimited();
+	}
+
+	// Ставит или снимает хук по текущим бюджетам
+	void update()
+	{
+		m_data.tripped = false;
+		m_data.active = std::min(std::min(m_data.stateInstructions, m_data.callInstructions),
+			std::min(m_data.stateDeadline, m_data.callDeadline)) != unlimited();
+		if (m_data.active)
+			lua_sethook(m_state, & TypeManagerDetail::watchdogHook, LUA_MASKCOUNT, m_data.interval);
+		else
+			removeHook();
+	}
+
+	// Чужой хук не трогаем
+	inline void removeHook()
+	{
+		if (lua_gethook(m_state) == & TypeManagerDetail::watchdogHook)
+			lua_sethook(m_state, 0, 0, 0);
+	}
+};
+
+inline void execLuaString(lua_State *m_state, const char *str)
+{
+	if (luaL_loadstring(m_state, str) != 0)
+	{
+		LuaSyntaxError err(lua_tostring(m_state, -1));
+		lua_pop(m_state, 1);
+		throw err;
+	}
+	if (lua_pcall(m_state, 0, LUA_MULTRET, 0) != 0)
+		TypeManagerDetail::throwCallError(m_state);
+}
+
+// Кэш скомпилированных фрагментов для многократно выполняемых строк.
+// Ключ - хэш исходного текста, скомпилированная функция хранится в реестре.
+// Кэш держит не больше capacity фрагментов (0 - без ограничения): при переполнении вытесняется
+// фрагмент, дольше всех не выполнявшийся. Строки, собираемые на лету, иначе занимали бы память без предела.
+// Содержимое кэша можно сохранить в файл байткодом (lua_dump) и загрузить при следующем запуске
+class LuaChunkCache : public boost::noncopyable
+{
+public:
+	enum { defaultCapacity = 256 };
+
+	LuaChunkCache(lua_State* state, std::size_t capacity = defaultCapacity) : m_state(state), m_capacity(capacity) {}
+
+	~LuaChunkCache()
+	{
+		clear();
+	}
+
+	// То же, что execLuaString, но без повторной компиляции
+	inline void exec(const char* source)
+	{
+		push(source); // Lua Stack +1 func
+		if (lua_pcall(m_state, 0, LUA_MULTRET, 0) != 0)
+			TypeManagerDetail::throwCallError(m_state);
+	}
+
+	// Lua Stack +1 func
+	inline void push(const char* source)
+	{
+		std::size_t len = std::strlen(source);
+		std::size_t key = boost::hash_range(source, source + len);
+		ChunksMap::iterator it = m_chunks.find(key);
+		if (it != m_chunks.end() && it->second.source.size() == len && std::memcmp(it->second.source.data(), source, len) == 0)
+		{
+			m_order.splice(m_order.begin(), m_order, it->second.use);
+			lua_rawgeti(m_state, LUA_REGISTRYINDEX, it->second.ref); // Lua Stack +1 func
+			return;
+		}
+		if (luaL_loadbuffer(m_state, source, len, source) != 0) // Lua Stack +1 func|err
+		{
+			LuaSyntaxError err(lua_tostring(m_state, -1));
+			lua_pop(m_state, 1);
+			throw err;
+		}
+		// При коллизии хэшей фрагмент просто не кэшируется
+		if (it == m_chunks.end())
+			store(key, std::string(source, len), -1);
+	}
+
+	inline void clear()
+	{
+		for (ChunksMap::iterator it = m_chunks.begin(); it != m_chunks.end(); ++it)
+			luaL_unref(m_state, LUA_REGISTRYINDEX, it->second.ref);
+		m_chunks.clear();
+		m_order.clear();
+	}
+
+	inline std::size_t size() const
+	{
+		return m_chunks.size();
+	}
+
+	// Сохраняет байткод всех фрагментов кэша. Байткод Lua зависит от платформы и версии.
+	// Возвращает false, если файл не записан или lua_dump не смог выгрузить фрагмент
+	bool save(const char* filename) const
+	{
+		std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		out.write(cacheSignature(), std::strlen(cacheSignature()));
+		std::string code;
+		for (ChunksMap::const_iterator it = m_chunks.begin(); it != m_chunks.end(); ++it)
+		{
+			code.clear();
+			lua_rawgeti(m_state, LUA_REGISTRYINDEX, it->second.ref); // Lua Stack +1 func
+			const int status = lua_dump(m_state, & LuaChunkCache::writer, &code);
+			lua_pop(m_state, 1); // Lua Stack 0
+			if (status != 0)
+				return false;
+			writeBlock(out, it->second.source);
+			writeBlock(out, code);
+		}
+		return out.good();
+	}
+
+	// Загружает байткод, сохраненный save(). Уже закэшированные фрагменты не заменяются.
+	// Возвращает false и для обрезанного файла, фрагменты до места обрыва при этом остаются в кэше
+	bool load(const char* filename)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		if (!in)
+			return false;
+		in.seekg(0, std::ios::end);
+		const std::streamoff end = in.tellg();
+		in.seekg(0, std::ios::beg);
+		std::string sig(std::strlen(cacheSignature()), '\0');
+		if (!in.read(&sig[0], sig.size()) || sig != cacheSignature())
+			return false;
+		std::string source, code;
+		// Целый файл заканчивается ровно на границе фрагмента
+		while (in.peek() != std::ifstream::traits_type::eof())
+		{
+			if (!readBlock(in, end, source) || !readBlock(in, end, code))
+				return false;
+			std::size_t key = boost::hash_range(source.data(), source.data() + source.size());
+			if (m_chunks.find(key) != m_chunks.end())
+				continue;
+			if (luaL_loadbuffer(m_state, code.data(), code.size(), source.c_str()) != 0) // Lua Stack +1 func|err
+			{
+				lua_pop(m_state, 1);
+				return false;
+			}
+			store(key, source, -1);
+			lua_pop(m_state, 1); // Lua Stack 0
+		}
+		return true;
+	}
+
+private:
+	// Ключи в порядке использования, в начале - последний выполненный
+	typedef std::list<std::size_t> UseList;
+
+	struct Chunk
+	{
+		std::string source;
+		int ref;
+		UseList::iterator use;
+	};
+	typedef std::map<std::size_t, Chunk> ChunksMap;
+
+	lua_State* m_state;
+	std::size_t m_capacity;
+	ChunksMap m_chunks;
+	UseList m_order;
+
+	// Функция остается на стеке
+	inline void store(std::size_t key, const std::string& source, int idx)
+	{
+		lua_pushvalue(m_state, idx); // Lua Stack +1 func
+		if (m_capacity != 0 && m_chunks.size() >= m_capacity)
+		{
+			ChunksMap::iterator oldest = m_chunks.find(m_order.back());
+			luaL_unref(m_state, LUA_REGISTRYINDEX, oldest->second.ref);
+			m_chunks.erase(oldest);
+			m_order.pop_back();
+		}
+		Chunk& chunk = m_chunks[key];
+		chunk.source = source;
+		chunk.ref = luaL_ref(m_state, LUA_REGISTRYINDEX); // Lua Stack 0
+		chunk.use = m_order.insert(m_order.begin(), key);
+	}
+
+	static inline const char* cacheSignature()
+	{
+		return "LUABINDER_ChunkCache1\n";
+	}
+
+	static int writer(lua_State*, const void* p, size_t sz, void* ud)
+	{
+		reinterpret_cast<std::string*> (ud)->append(reinterpret_cast<const char*> (p), sz);
+		return 0;
+	}
+
+	static void writeBlock(std::ostream& out, const std::string& block)
+	{
+		unsigned int len = static_cast<unsigned int> (block.size());
+		out.write(reinterpret_cast<const char*> (&len), sizeof (len));
+		out.write(block.data(), block.size());
+	}
+
+	// Длина блока не может выходить за конец файла end: испорченная длина иначе стоила бы выделения до 4 Гб
+	static bool readBlock(std::istream& in, std::streamoff end, std::string& block)
+	{
+		unsigned int len = 0;
+		if (!in.read(reinterpret_cast<char*> (&len), sizeof (len)))
+			return false;
+		if (static_cast<std::streamoff> (len) > end - static_cast<std::streamoff> (in.tellg()))
+			return false;
+		block.resize(len);
+		return len == 0 || in.read(&block[0], len);
+	}
+};
+
+// Распределитель памяти контекста Lua: lua_newstate(&LuaArenaAllocator::alloc, &arena) или arena.newState().
+// Блоки до maxPooled байт берутся из списков свободных блоков с шагом granularity, списки наполняются
+// нарезкой больших кусков (chunkSize) памяти. Шаг и граница подобраны под типичные объекты биндера:
+// userdata с DataHolder и ValueHolder, замыкания с парой upvalue, короткие строки и таблицы.
+// Большие блоки выделяются через malloc. Один распределитель обслуживает один контекст и не потокобезопасен
+class LuaArenaAllocator : public boost::noncopyable
+{
+public:
+	enum { granularity = 16, maxPooled = 512, classCount = maxPooled / granularity };
+
+	struct Stats
+	{
+		// Выделения и освобождения блоков, перенос при изменении размера считается и тем и другим
+		std::size_t allocations;
+		std::size_t frees;
+		// Выделения больших блоков через malloc
+		std::size_t largeAllocations;
+		// Байт, занятых Lua сейчас и в максимуме
+		std::size_t bytesInUse;
+		std::size_t peakBytes;
+		// Байт в кусках арены
+		std::size_t chunkBytes;
+		// Выделения по классам размеров: perClass[i] - блоки (i * granularity, (i + 1) * granularity]
+		std::size_t perClass[classCount];
+	};
+
+	explicit LuaArenaAllocator(std::size_t chunkSize = 64 * 1024) :
+	m_chunkSize(std::max<std::size_t>(chunkSize, maxPooled)), m_chunk(0), m_cursor(0), m_end(0), m_large(0), m_adopted(0)
+	{
+		std::fill(m_free, m_free + classCount, static_cast<FreeBlock*> (0));
+		std::memset(&m_stats, 0, sizeof (m_stats));
+	}
+
+	~LuaArenaAllocator()
+	{
+		releaseLarge();
+		releaseAdopted();
+		for (std::size_t i = 0; i < m_chunks.size(); ++i)
+			std::free(m_chunks[i]);
+	}
+
+	inline lua_State* newState()
+	{
+		return lua_newstate(& LuaArenaAllocator::alloc, this);
+	}
+
+	// Перематывает арену для следующего контекста: списки свободных блоков сбрасываются, нарезка кусков
+	// начинается сначала, куски остаются за ареной. Контекст должен быть закрыт lua_close: только __gc
+	// освобождают принадлежащие ему объекты C++ (конвертеры, реестр MetaData, копии GcPointerPolicy).
+	// lua_close в арене дешев, блоки Lua просто возвращаются в списки. Открытый контекст - ошибка
+	void reset()
+	{
+		if (m_stats.bytesInUse != 0)
+			throw LuaException("LuaArenaAllocator::reset: the Lua state is still open, call lua_close first");
+		releaseLarge();
+		releaseAdopted();
+		std::fill(m_free, m_free + classCount, static_cast<FreeBlock*> (0));
+		m_chunk = 0;
+		m_cursor = m_chunks.empty() ? 0 : m_chunks[0];
+		m_end = m_chunks.empty() ? 0 : m_chunks[0] + m_chunkSize;
+		m_stats.bytesInUse = 0;
+	}
+
+	inline const Stats& stats() const
+	{
+		return m_stats;
+	}
+
+	static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+	{
+		LuaArenaAllocator* arena = static_cast<LuaArenaAllocator*> (ud);
+		if (nsize == 0)
+		{
+			if (ptr)
+				arena->release(ptr, osize);
+			return 0;
+		}
+		if (!ptr)
+			return arena->acquire(nsize);
+		// Блок того же класса подходит как есть
+		if (osize <= maxPooled && nsize <= maxPooled && sizeClass(osize) == sizeClass(nsize))
+		{
+			arena->m_stats.bytesInUse += nsize - osize;
+			arena->notePeak();
+			return ptr;
+		}
+		if (osize > maxPooled && nsize > maxPooled)
+			return arena->reallocLarge(ptr, osize, nsize);
+		void* block = arena->acquire(nsize);
+		if (block)
+		{
+			std::memcpy(block, ptr, std::min(osize, nsize));
+			arena->release(ptr, osize);
+		}
+		else if (nsize < osize)
+		{
+			// Lua 5.1 требует, чтобы уменьшение блока не отказывало: остается старый блок
+			arena->keepShrunk(ptr, osize, nsize);
+			return ptr;
+		}
+		return block;
+	}
+
+private:
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	// Заголовок большого блока: все большие блоки связаны в список, чтобы reset мог их освободить
+	union LargeHeader
+	{
+		struct
+		{
+			LargeHeader* prev;
+			LargeHeader* next;
+		} links;
+		TypeManagerDetail::StackImplBase::LuaUserAlign align;
+	};
+
+	std::size_t m_chunkSize;
+	std::vector<char*> m_chunks;
+	// Текущий нарезаемый кусок и его свободная часть
+	std::size_t m_chunk;
+	char* m_cursor;
+	char* m_end;
+	FreeBlock* m_free[classCount];
+	LargeHeader* m_large;
+	// Большие блоки, уменьшенные до размера списков без переноса. Lua освободит их в списки,
+	// память возвращается в malloc при reset и в деструкторе
+	LargeHeader* m_adopted;
+	Stats m_stats;
+
+	static inline std::size_t sizeClass(std::size_t size)
+	{
+		return (size - 1) / granularity;
+	}
+
+	inline void notePeak()
+	{
+		if (m_stats.bytesInUse > m_stats.peakBytes)
+			m_stats.peakBytes = m_stats.bytesInUse;
+	}
+
+	void* acquire(std::size_t size)
+	{
+		void* block = size <= maxPooled ? acquirePooled(sizeClass(size)) : acquireLarge(size);
+		if (block)
+		{
+			++m_stats.allocations;
+			m_stats.bytesInUse += size;
+			notePeak();
+		}
+		return block;
+	}
+
+	void release(void* ptr, std::size_t size)
+	{
+		++m_stats.frees;
+		m_stats.bytesInUse -= size;
+		if (size > maxPooled)
+			return releaseLarge(ptr);
+		FreeBlock* block = static_cast<FreeBlock*> (ptr);
+		std::size_t cls = sizeClass(size);
+		block->next = m_free[cls];
+		m_free[cls] = block;
+	}
+
+	void* acquirePooled(std::size_t cls)
+	{
+		++m_stats.perClass[cls];
+		if (FreeBlock* block = m_free[cls])
+		{
+			m_free[cls] = block->next;
+			return block;
+		}
+		std::size_t bytes = (cls + 1) * granularity;
+		if (static_cast<std::size_t> (m_end - m_cursor) < bytes && !nextChunk())
+			return 0;
+		void* block = m_cursor;
+		m_cursor += bytes;
+		return block;
+	}
+
+	// Переходит к следующему куску, выделяя новый при необходимости. Остаток текущего куска теряется до reset
+	bool nextChunk()
+	{
+		std::size_t next = m_cursor ? m_chunk + 1 : 0;
+		if (next == m_chunks.size())
+		{
+			char* chunk = static_cast<char*> (std::malloc(m_chunkSize));
+			if (!chunk)
+				return false;
+			m_chunks.push_back(chunk);
+			m_stats.chunkBytes += m_chunkSize;
+		}
+		m_chunk = next;
+		m_cursor = m_chunks[next];
+		m_end = m_cursor + m_chunkSize;
+		return true;
+	}
+
+	void* acquireLarge(std::size_t size)
+	{
+		LargeHeader* header = static_cast<LargeHeader*> (std::malloc(sizeof (LargeHeader) + size));
+		if (!header)
+			return 0;
+		++m_stats.largeAllocations;
+		link(header);
+		return header + 1;
+	}
+
+	void* reallocLarge(void* ptr, std::size_t osize, std::size_t nsize)
+	{
+		LargeHeader* header = static_cast<LargeHeader*> (ptr) - 1;
+		unlink(header);
+		LargeHeader* moved = static_cast<LargeHeader*> (std::realloc(header, sizeof (LargeHeader) + nsize));
+		if (!moved)
+		{
+			link(header);
+			return nsize < osize ? keepShrunk(ptr, osize, nsize) : 0;
+		}
+		link(moved);
+		m_stats.bytesInUse += nsize - osize;
+		notePeak();
+		return moved + 1;
+	}
+
+	void releaseLarge(void* ptr)
+	{
+		LargeHeader* header = static_cast<LargeHeader*> (ptr) - 1;
+		unlink(header);
+		std::free(header);
+	}
+
+	void releaseLarge()
+	{
+		while (m_large)
+			releaseLarge(m_large + 1);
+	}
+
+	// Уменьшение без переноса, когда для нового размера не нашлось памяти. Блок не меньше запрошенного,
+	// а освобождение по новому размеру должно найти его там, где ищет: большой блок, ставший маленьким,
+	// уходит из списка больших, иначе release положил бы в списки блок, который освободит releaseLarge
+	void* keepShrunk(void* ptr, std::size_t osize, std::size_t nsize)
+	{
+		if (osize > maxPooled && nsize <= maxPooled)
+		{
+			LargeHeader* header = static_cast<LargeHeader*> (ptr) - 1;
+			unlink(header);
+			header->links.next = m_adopted;
+			m_adopted = header;
+		}
+		m_stats.bytesInUse -= osize - nsize;
+		return ptr;
+	}
+
+	void releaseAdopted()
+	{
+		while (LargeHeader* header = m_adopted)
+		{
+			m_adopted = header->links.next;
+			std::free(header);
+		}
+	}
+
+	inline void link(LargeHeader* header)
+	{
+		header->links.prev = 0;
+		header->links.next = m_large;
+		if (m_large)
+			m_large->links.prev = header;
+		m_large = header;
+	}
+
+	inline void unlink(LargeHeader* header)
+	{
+		if (header->links.prev)
+			header->links.prev->links.next = header->links.next;
+		else
+			m_large = header->links.next;
+		if (header->links.next)
+			header->links.next->links.prev = header->links.prev;
+	}
+};
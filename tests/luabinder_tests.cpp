@@ -0,0 +1,853 @@
+// Регрессионные тесты luabinder.hpp. Собираются целью luabinder_tests из CMakeLists.txt в корне репозитория
+// и запускаются через ctest. Каждый тест получает свежий контекст Lua и бросает исключение при ошибке.
+// Цели luabinder_pool_tests и luabinder_profile_tests собирают тот же файл с LUABINDER_ENGINE_POOL
+// и LUABINDER_PROFILE и добавляют тесты LuaEnginePool и профилировщика
+#include "luabinder.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#ifdef LUABINDER_ENGINE_POOL
+#	define BOOST_BIND_GLOBAL_PLACEHOLDERS
+#	include <boost/bind.hpp>
+#endif
+
+namespace
+{
+	struct TestFailure
+	{
+		std::string what;
+
+		TestFailure(const std::string& w) : what(w) {}
+	};
+
+	inline void check(bool cond, const char* expr, int line)
+	{
+		if (cond)
+			return;
+		std::ostringstream message;
+		message << __FILE__ << ":" << line << ": " << expr;
+		throw TestFailure(message.str());
+	}
+#	define LUABINDER_CHECK(cond) check((cond), #cond, __LINE__)
+
+	// Контекст Lua на время теста. Привязки должны быть разрушены до закрытия контекста
+	class TestState : public boost::noncopyable
+	{
+	public:
+		TestState() : m_state(luaL_newstate())
+		{
+			luaL_openlibs(m_state);
+		}
+
+		~TestState()
+		{
+			lua_close(m_state);
+		}
+
+		inline operator lua_State*() const
+		{
+			return m_state;
+		}
+
+	private:
+		lua_State* m_state;
+	};
+
+	struct A
+	{
+		int a;
+
+		A() : a(1) {}
+	};
+
+	struct B
+	{
+		double b;
+
+		B() : b(2) {}
+	};
+
+	A getA()
+	{
+		return A();
+	}
+
+	double readB(const B* b)
+	{
+		return b->b;
+	}
+
+	// Два типа, зарегистрированные от одного менеджера, получили бы одинаковые номера в общем реестре
+	void branchingRegistration()
+	{
+		TestState L;
+		LTypesManager root;
+		LTypesManager::AddedType<A>::type::pointer withA = root.registerType<A>("A", L);
+		bool rejected = false;
+		try
+		{
+			root.registerType<B>("B", L);
+		}
+		catch (LuaException&)
+		{
+			rejected = true;
+		}
+		LUABINDER_CHECK(rejected);
+
+		LuaEngine<LTypesManager::AddedType<A>::type> engineA(L, withA);
+		LuaEngine<LTypesManager::AddedType<A>::type::AddedType<B>::type> engine = engineA.regType<B>("B");
+		engine.regFunc("getA", &getA).regFunc("readB", &readB);
+		execLuaString(L, "assert(not pcall(readB, getA()))");
+	}
+
+	// Обрезанный файл кэша не должен считаться целым
+	void truncatedChunkCache()
+	{
+		const char* filename = "luabinder_tests_cache.bin";
+		std::string bytes;
+		{
+			TestState L;
+			LuaChunkCache cache(L);
+			cache.exec("x = 1");
+			cache.exec("y = 2");
+			LUABINDER_CHECK(cache.save(filename));
+			std::ifstream in(filename, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+		{
+			TestState L;
+			LuaChunkCache cache(L);
+			LUABINDER_CHECK(cache.load(filename));
+			LUABINDER_CHECK(cache.size() == 2);
+		}
+		{
+			std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+			out.write(bytes.data(), bytes.size() - 1);
+		}
+		TestState L;
+		LuaChunkCache cache(L);
+		const bool loaded = cache.load(filename);
+		std::remove(filename);
+		LUABINDER_CHECK(!loaded);
+		LUABINDER_CHECK(cache.size() == 1);
+	}
+
+	// Длина блока за концом файла отвергается до выделения памяти под блок
+	void corruptChunkLength()
+	{
+		const char* filename = "luabinder_tests_corrupt.bin";
+		{
+			TestState L;
+			LuaChunkCache cache(L);
+			LUABINDER_CHECK(cache.save(filename));
+		}
+		{
+			std::ofstream out(filename, std::ios::binary | std::ios::app);
+			const unsigned int len = 0xFFFFFFF0u;
+			out.write(reinterpret_cast<const char*> (&len), sizeof (len));
+			out.write("return 1", 8);
+		}
+		TestState L;
+		LuaChunkCache cache(L);
+		const bool loaded = cache.load(filename);
+		std::remove(filename);
+		LUABINDER_CHECK(!loaded);
+		LUABINDER_CHECK(cache.size() == 0);
+	}
+
+	// Переполненный кэш вытесняет фрагмент, дольше всех не выполнявшийся
+	void chunkCacheEviction()
+	{
+		TestState L;
+		LuaChunkCache cache(L, 2);
+		const char* sources[] = { "return 1", "return 2", "return 3" };
+		cache.push(sources[0]);
+		lua_setglobal(L, "first");
+		cache.push(sources[1]);
+		lua_setglobal(L, "second");
+		cache.exec(sources[0]);
+		cache.exec(sources[2]);
+		LUABINDER_CHECK(cache.size() == 2);
+		cache.push(sources[0]);
+		lua_getglobal(L, "first");
+		LUABINDER_CHECK(lua_rawequal(L, -1, -2) != 0);
+		lua_pop(L, 2);
+		cache.push(sources[1]);
+		lua_getglobal(L, "second");
+		LUABINDER_CHECK(lua_rawequal(L, -1, -2) == 0);
+		lua_pop(L, 2);
+		LUABINDER_CHECK(cache.size() == 2);
+	}
+
+	char greeting[] = "hello";
+
+	char* mutableName()
+	{
+		return greeting;
+	}
+
+	long double extended()
+	{
+		return 1.5L;
+	}
+
+	// char* возвращается строкой, результат без конвертера (long double) отбрасывается
+	void scalarResults()
+	{
+		TestState L;
+		LuaEngine<> engine(L);
+		engine.regFunc("mutableName", &mutableName).regFunc("extended", &extended);
+		execLuaString(L, "assert(mutableName() == 'hello') assert(select('#', extended()) == 0)");
+	}
+
+	bool divmod(int a, int b, int* quotient, int* remainder)
+	{
+		if (b == 0)
+			return false;
+		*quotient = a / b;
+		*remainder = a % b;
+		return true;
+	}
+
+	// Значения, записанные через указатели на скаляры, возвращаются дополнительными результатами
+	void pointerOutParams()
+	{
+		TestState L;
+		LuaEngine<> engine(L);
+		engine.regFunc("divmod", &divmod);
+		execLuaString(L, "local ok, q, r = divmod(7, 2) assert(ok and q == 3 and r == 1)");
+	}
+
+	struct Position
+	{
+		float x, y;
+
+		Position() : x(0), y(0) {}
+	};
+
+	int bodiesAlive = 0;
+
+	struct Body
+	{
+		Position pos;
+
+		Body() { ++bodiesAlive; }
+		Body(const Body& other) : pos(other.pos) { ++bodiesAlive; }
+		~Body() { --bodiesAlive; }
+	};
+
+	// Указатель на поле держит владельца: сборка мусора между чтением поля и записью в него не освобождает Body
+	void propertyKeepsOwner()
+	{
+		TestState L;
+		typedef LTypesManager::AddedType<Position>::type WithPosition;
+		LuaEngine<WithPosition> positions = LuaEngine<>(L).regType<Position>("Position");
+		positions.regProperty("x", &Position::x);
+		LuaEngine<WithPosition::AddedType<Body>::type> engine = positions.regType<Body>("Body");
+		engine.regConstructor<Body ()>("Body").regProperty("pos", &Body::pos);
+		execLuaString(L, "p = Body().pos collectgarbage()");
+		LUABINDER_CHECK(bodiesAlive == 1);
+		execLuaString(L, "p.x = 5 assert(p.x == 5) p = nil collectgarbage()");
+		LUABINDER_CHECK(bodiesAlive == 0);
+	}
+
+	// Арена перематывается только после lua_close, иначе объекты C++ контекста не были бы освобождены
+	void arenaResetAfterClose()
+	{
+		LuaArenaAllocator arena(4096);
+		lua_State* L = arena.newState();
+		luaL_openlibs(L);
+		{
+			LuaEngine<LTypesManager::AddedType<Position>::type> engine = LuaEngine<>(L).regType<Position>("Position");
+			engine.regConstructor<Position ()>("Position");
+			execLuaString(L, "local t = {} for i = 1, 100 do t[i] = Position() end");
+		}
+		bool rejected = false;
+		try
+		{
+			arena.reset();
+		}
+		catch (LuaException&)
+		{
+			rejected = true;
+		}
+		lua_close(L);
+		LUABINDER_CHECK(rejected);
+		LUABINDER_CHECK(arena.stats().bytesInUse == 0);
+		arena.reset();
+	}
+
+	// Сопрограмма, созданная до начала бюджета, тоже прерывается; второй сторож контекста отвергается
+	void watchdogCoroutines()
+	{
+		TestState L;
+		LuaWatchdog watchdog(L);
+		bool rejected = false;
+		try
+		{
+			LuaWatchdog second(L);
+		}
+		catch (LuaException&)
+		{
+			rejected = true;
+		}
+		LUABINDER_CHECK(rejected);
+		execLuaString(L, "spin = coroutine.wrap(function() while true do end end)");
+		bool aborted = false;
+		try
+		{
+			LuaWatchdog::Scope scope(watchdog, 1000000, 0);
+			execLuaString(L, "spin()");
+		}
+		catch (LuaBudgetError&)
+		{
+			aborted = true;
+		}
+		LUABINDER_CHECK(aborted);
+	}
+
+	// Число записей таблицы на вершине стека, таблица снимается
+	int popTableSize(lua_State* L)
+	{
+		int size = 0;
+		if (lua_istable(L, -1))
+		{
+			lua_pushnil(L);
+			while (lua_next(L, -2))
+			{
+				++size;
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+		return size;
+	}
+
+	// MetaData освобождается вместе с последним менеджером, слоты LUABINDER_Alloc и реестра переиспользуются.
+	// Менеджер с зарегистрированными функциями закреплен в реестре до lua_close, поэтому здесь только типы
+	void registrationTeardown()
+	{
+		TestState L;
+		int allocSize = 0;
+		int registrySize = 0;
+		for (int i = 0; i < 50; ++i)
+		{
+			{
+				LuaEngine<LTypesManager::AddedType<A>::type::AddedType<B>::type> engine =
+					LuaEngine<>(L).regType<A>("A").regType<B>("B");
+			}
+			lua_gc(L, LUA_GCCOLLECT, 0);
+			lua_getfield(L, LUA_REGISTRYINDEX, "LUABINDER_Alloc");
+			const int alloc = popTableSize(L);
+			lua_pushvalue(L, LUA_REGISTRYINDEX);
+			const int registry = popTableSize(L);
+			if (i == 0)
+			{
+				allocSize = alloc;
+				registrySize = registry;
+			}
+			LUABINDER_CHECK(alloc == allocSize);
+			LUABINDER_CHECK(registry == registrySize);
+		}
+		LUABINDER_CHECK(allocSize == 2);
+	}
+
+	struct Entity
+	{
+		int id;
+
+		Entity() : id(0) {}
+	};
+
+	Entity world[2];
+
+	Entity* entity(int i)
+	{
+		return &world[i];
+	}
+
+	// Один указатель - один userdata, пока он жив в Lua; кэш слабый и не держит объект от сборки
+	void cachedPointerIdentity()
+	{
+		TestState L;
+		LuaEngine<LTypesManager::AddedType<Entity>::type> engine = LuaEngine<>(L).regType<Entity>("Entity");
+		engine.regFunc("entity", &entity, CachedPointerPolicy());
+		execLuaString(L,
+			"assert(rawequal(entity(0), entity(0))) assert(not rawequal(entity(0), entity(1)))\n"
+			"local seen = {[entity(0)] = true} assert(seen[entity(0)])\n"
+			"marks = setmetatable({}, {__mode = 'k'}) marks[entity(1)] = true");
+		// Userdata с __gc доживает до второго цикла сборки
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		execLuaString(L, "assert(next(marks) == nil)");
+
+		execLuaString(L, "kept = entity(0)");
+		engine.forgetObject(&world[0]);
+		execLuaString(L, "assert(not rawequal(kept, entity(0))) assert(rawequal(entity(0), entity(0)))");
+	}
+
+	struct Counter
+	{
+		int hits;
+
+		Counter() : hits(0) {}
+		void hit() { ++hits; }
+		int get() const { return hits; }
+	};
+
+	Counter counter;
+
+	Counter* borrowCounter()
+	{
+		return &counter;
+	}
+
+	const Counter* viewCounter()
+	{
+		return &counter;
+	}
+
+	// Заимствованный указатель: методы и свойства доступны, __gc нет, константность и тип проверяются
+	void borrowedPointers()
+	{
+		TestState L;
+		LuaEngine<LTypesManager::AddedType<Counter>::type> engine = LuaEngine<>(L).regType<Counter>("Counter");
+		engine.regFunc("borrow", &borrowCounter, BorrowedPointerPolicy())
+			.regFunc("view", &viewCounter, BorrowedPointerPolicy())
+			.regMethod("hit", &Counter::hit).regMethod("get", &Counter::get)
+			.regProperty("hits", &Counter::hits);
+		execLuaString(L,
+			"local c = borrow() c:hit() c:hit() assert(c:get() == 2 and c.hits == 2)\n"
+			"c.hits = 5 assert(view():get() == 5)\n"
+			"assert(rawget(getmetatable(c), '__gc') == nil)\n"
+			"assert(not pcall(function() view():hit() end))\n"
+			"assert(not pcall(c.get, io.stdout))");
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		LUABINDER_CHECK(counter.hits == 5);
+	}
+
+	// Результаты функций Lua копируются до снятия со стека и переживают сборку мусора
+	void luaFunctionResults()
+	{
+		TestState L;
+		LuaEngine<LTypesManager::AddedType<Position>::type> engine = LuaEngine<>(L).regType<Position>("Position");
+		engine.regConstructor<Position ()>("Position").regProperty("x", &Position::x);
+		execLuaString(L,
+			"function label(n) return string.rep('ab', n) .. '\\0z' end\n"
+			"function place(x) local p = Position() p.x = x return p end");
+		std::string label = engine.getFunction<std::string (int)>("label")(3);
+		Position p = engine.getFunction<Position (float)>("place")(2.5f);
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		LUABINDER_CHECK(label == std::string("ababab\0z", 8));
+		LUABINDER_CHECK(p.x == 2.5f);
+	}
+
+	std::vector<float> samples(4);
+	float frame[6];
+
+	LuaArrayView<float> samplesView()
+	{
+		return LuaArrayView<float>(samples);
+	}
+
+	LuaArrayView<float> frameView()
+	{
+		return LuaArrayView<float>(frame, 6);
+	}
+
+	// fill, copy (в том числе с перекрытием внутри одного буфера) и map меняют буферы C++ на месте
+	void arrayViewOperations()
+	{
+		TestState L;
+		LuaEngine<> engine(L);
+		engine.regArray<float>().regFunc("samples", &samplesView).regFunc("frame", &frameView);
+		execLuaString(L,
+			"local a, f = samples(), frame()\n"
+			"a:fill(2) a[2] = 5 assert(#a == 4 and a[2] == 5 and a[5] == nil)\n"
+			"assert(not pcall(function() a[5] = 1 end))\n"
+			"f:fill(0) assert(f:copy(a) == 4) assert(f:copy(a, 5, 1) == 2)\n"
+			"assert(f:copy(f, 2, 1, 3) == 3)\n"
+			"a:map(function(x, i) if i ~= 3 then return x * i end end)");
+		const float expectedSamples[] = { 2, 10, 2, 8 };
+		const float expectedFrame[] = { 2, 2, 5, 2, 2, 5 };
+		LUABINDER_CHECK(std::equal(samples.begin(), samples.end(), expectedSamples));
+		LUABINDER_CHECK(std::equal(frame, frame + 6, expectedFrame));
+	}
+
+	std::vector<int> doubled(const std::vector<int>& values)
+	{
+		std::vector<int> result(values);
+		for (std::size_t i = 0; i < result.size(); ++i)
+			result[i] *= 2;
+		return result;
+	}
+
+	std::map<std::string, double> scaled(const std::map<std::string, double>& values, double k)
+	{
+		std::map<std::string, double> result;
+		for (std::map<std::string, double>::const_iterator it = values.begin(); it != values.end(); ++it)
+			result[it->first] = it->second * k;
+		return result;
+	}
+
+	// Таблицы Lua в std::vector и std::map и обратно, числовые ключи становятся строковыми
+	void containerRoundTrips()
+	{
+		TestState L;
+		LuaEngine<> engine(L);
+		engine.regFunc("doubled", &doubled).regFunc("scaled", &scaled);
+		execLuaString(L,
+			"local v = doubled({1, 2, 3}) assert(#v == 3 and v[1] == 2 and v[3] == 6)\n"
+			"assert(#doubled({}) == 0)\n"
+			"local m = scaled({a = 1, b = 2.5}, 2) assert(m.a == 2 and m.b == 5)\n"
+			"local n = scaled({10, 20, x = 1}, 1) assert(n['1'] == 10 and n['2'] == 20 and n.x == 1 and n[1] == nil)");
+	}
+
+	std::size_t countZeros(LuaStringRef bytes)
+	{
+		return static_cast<std::size_t> (std::count(bytes.data(), bytes.data() + bytes.size(), '\0'));
+	}
+
+	std::string reversed(const std::string& bytes)
+	{
+		return std::string(bytes.rbegin(), bytes.rend());
+	}
+
+	// Строки с нулевыми символами проходят без обрезки в обе стороны, LuaStringRef и std::string
+	void embeddedZeros()
+	{
+		TestState L;
+		LuaEngine<> engine(L);
+		engine.regFunc("countZeros", &countZeros).regFunc("reversed", &reversed);
+		execLuaString(L,
+			"assert(countZeros('a\\0b\\0\\0') == 3) assert(countZeros('') == 0)\n"
+			"local r = reversed('x\\0y') assert(#r == 3 and r == 'y\\0x')\n"
+			"assert(not pcall(countZeros, {}))");
+	}
+
+	struct Tag
+	{
+		int tag[3];
+	};
+
+	struct Shape
+	{
+		float area;
+
+		Shape(float a = 0) : area(a) {}
+		float getArea() const { return area; }
+	};
+
+	// Shape - не первая база, указатель на нее смещен относительно начала Square
+	struct Square : Tag, Shape
+	{
+		Square(float a) : Shape(a) {}
+	};
+
+	Square bigSquare(9);
+
+	float addAreas(const Shape& a, const Shape& b)
+	{
+		return a.area + b.area;
+	}
+
+	bool lessArea(const Shape& a, const Shape& b)
+	{
+		return a.area < b.area;
+	}
+
+	std::string shapeName(const Shape&)
+	{
+		return "shape";
+	}
+
+	std::string squareName(const Square&)
+	{
+		return "square";
+	}
+
+	Square* borrowSquare()
+	{
+		return &bigSquare;
+	}
+
+	// Метаметоды базы достаются наследнику при регистрации и после нее, собственные метаметоды наследника остаются
+	void metamethodInheritance()
+	{
+		TestState L;
+		typedef LTypesManager::AddedType<Shape>::type WithShape;
+		LuaEngine<WithShape> shapes = LuaEngine<>(L).regType<Shape>("Shape");
+		shapes.regConstructor<Shape (float)>("Shape").regMethod("area", &Shape::getArea).regMeta("Shape", "__add", &addAreas);
+		LuaEngine<WithShape::AddedType<Square>::type> engine = shapes.regType<Square, Shape>("Square");
+		engine.regConstructor<Square (float)>("Square").regFunc("borrowSquare", &borrowSquare, BorrowedPointerPolicy())
+			.regMeta("Square", "__tostring", &squareName)
+			.regMeta("Shape", "__lt", &lessArea).regMeta("Shape", "__tostring", &shapeName);
+		LUABINDER_CHECK((TypeManagerDetail::baseOffset<Square, Shape>() != 0));
+		execLuaString(L,
+			"local a, b = Square(2), Square(3)\n"
+			"assert(a:area() == 2 and a + b == 5 and a + Shape(1) == 3)\n"
+			"assert(a < b and not (b < a) and a < Shape(4))\n"
+			"assert(tostring(a) == 'square' and tostring(Shape(1)) == 'shape')\n"
+			"local big = borrowSquare() assert(big + a == 11 and a < big and tostring(big) == 'square')");
+	}
+
+	std::string describeInt(int)
+	{
+		return "int";
+	}
+
+	std::string describeDouble(double)
+	{
+		return "double";
+	}
+
+	std::string describeText(const std::string&)
+	{
+		return "string";
+	}
+
+	std::string describeShape(const Shape&)
+	{
+		return "shape";
+	}
+
+	std::string describePair(int, int)
+	{
+		return "pair";
+	}
+
+	// Перегрузки выбираются по числу аргументов и их типам; из совпавших по признакам - первая
+	// зарегистрированная, без подходящей перегрузки - ошибка со списком типов аргументов
+	void overloadDispatch()
+	{
+		TestState L;
+		typedef LTypesManager::AddedType<Shape>::type WithShape;
+		LuaEngine<WithShape> shapes = LuaEngine<>(L).regType<Shape>("Shape");
+		LuaEngine<WithShape::AddedType<Square>::type> engine = shapes.regType<Square, Shape>("Square");
+		engine.regConstructor<Square (float)>("Square")
+			.regOverload("describe", &describeInt).regOverload("describe", &describeDouble)
+			.regOverload("describe", &describeText).regOverload("describe", &describeShape)
+			.regOverload("describe", &describePair);
+		execLuaString(L,
+			"assert(describe(1) == 'int' and describe(1.5) == 'int')\n"
+			"assert(describe('x') == 'string' and describe(Square(1)) == 'shape' and describe(1, 2) == 'pair')\n"
+			"local ok, err = pcall(describe, {}) assert(not ok and err:find(\"no overload of 'describe' matches arguments (table)\", 1, true))\n"
+			"ok, err = pcall(describe, io.stdout) assert(not ok and err:find('(userdata)', 1, true))\n"
+			"assert(not pcall(describe, 1, 'x')) assert(not pcall(describe))");
+	}
+
+#ifdef LUABINDER_ENGINE_POOL
+	typedef LTypesManager::AddedType<Shape>::type PoolTypes;
+
+	// Общее состояние заданий пула: сумма результатов, потоки заданий и задание, держащее свой поток
+	struct PoolProbe
+	{
+		boost::mutex mutex;
+		boost::condition_variable changed;
+		float total;
+		int done;
+		bool blocked;
+		std::vector<boost::thread::id> threads;
+
+		PoolProbe() : total(0), done(0), blocked(false) {}
+	};
+
+	// Объект и функции из LuaRegistry доступны в контексте каждого потока
+	void poolArea(LuaEngine<PoolTypes>& engine, PoolProbe* probe, int i)
+	{
+		std::ostringstream source;
+		source << "area = Shape(" << i << "):area()";
+		execLuaString(engine.state(), source.str().c_str());
+		lua_getglobal(engine.state(), "area");
+		const float area = static_cast<float> (lua_tonumber(engine.state(), -1));
+		boost::unique_lock<boost::mutex> lock(probe->mutex);
+		probe->total += area;
+		probe->threads.push_back(boost::this_thread::get_id());
+		++probe->done;
+		probe->changed.notify_all();
+	}
+
+	// Держит свой поток, пока остальные задания не выполнены: задания из его очереди должны забрать другие
+	void poolBlocker(LuaEngine<PoolTypes>&, PoolProbe* probe, int others)
+	{
+		boost::unique_lock<boost::mutex> lock(probe->mutex);
+		probe->blocked = true;
+		probe->changed.notify_all();
+		const boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(10);
+		while (probe->done < others)
+			if (!probe->changed.timed_wait(lock, deadline))
+				throw LuaException("jobs queued behind a busy worker were not stolen");
+		probe->threads.push_back(boost::this_thread::get_id());
+	}
+
+	void poolFailure(LuaEngine<PoolTypes>& engine)
+	{
+		execLuaString(engine.state(), "error('pool job failed')");
+	}
+
+	void poolThrowInt(LuaEngine<PoolTypes>&)
+	{
+		throw 42;
+	}
+
+	lua_State* noState()
+	{
+		return 0;
+	}
+
+	// Регистрации повторяются в контекстах потоков, свободный поток забирает чужие задания,
+	// ошибки заданий и установки контекста доходят до wait()
+	void enginePool()
+	{
+		LuaRegistry<PoolTypes> registry = LuaRegistry<>().regType<Shape>("Shape");
+		registry.regConstructor<Shape (float)>("Shape").regMethod("area", &Shape::getArea);
+		PoolProbe probe;
+		{
+			LuaEnginePool<PoolTypes> pool(registry, 2);
+			const int jobs = 9;
+			pool.submit(boost::bind(&poolBlocker, _1, &probe, jobs));
+			{
+				// Остальные задания ставятся, когда первый поток уже занят
+				boost::unique_lock<boost::mutex> lock(probe.mutex);
+				while (!probe.blocked)
+					probe.changed.wait(lock);
+			}
+			for (int i = 1; i <= jobs; ++i)
+				pool.submit(boost::bind(&poolArea, _1, &probe, i));
+			pool.wait();
+			LUABINDER_CHECK(probe.total == 45);
+			LUABINDER_CHECK(probe.threads.size() == static_cast<std::size_t> (jobs + 1));
+			const boost::thread::id blockerThread = probe.threads.back();
+			for (int i = 0; i < jobs; ++i)
+				LUABINDER_CHECK(probe.threads[i] != blockerThread);
+
+			pool.submit(&poolFailure);
+			pool.submit(&poolThrowInt);
+			std::vector<std::string> errors;
+			try
+			{
+				pool.wait();
+			}
+			catch (LuaRuntimeError& e)
+			{
+				errors.push_back(e.what);
+			}
+			LUABINDER_CHECK(errors.size() == 1);
+			LUABINDER_CHECK(errors[0].find("pool job failed") != std::string::npos || errors[0] == "unknown exception");
+			// После ошибки пул продолжает работать, список ошибок очищен
+			pool.submit(boost::bind(&poolArea, _1, &probe, 5));
+			pool.wait();
+		}
+		LUABINDER_CHECK(probe.total == 50);
+
+		LuaEnginePool<PoolTypes> broken(registry, 1, &noState);
+		broken.submit(boost::bind(&poolArea, _1, &probe, 1));
+		bool reported = false;
+		try
+		{
+			broken.wait();
+		}
+		catch (LuaRuntimeError& e)
+		{
+			reported = e.what.find("setup failed") != std::string::npos;
+		}
+		LUABINDER_CHECK(reported);
+	}
+#endif
+
+#ifdef LUABINDER_PROFILE
+	Shape makeShape(float area)
+	{
+		return Shape(area);
+	}
+
+	// Вызовы, ошибки преобразования и созданные userdata считаются по каждой привязке,
+	// у перегрузок и метаметодов - общей записью на имя
+	void profilerCounters()
+	{
+		TestState L;
+		LuaEngine<LTypesManager::AddedType<Shape>::type> engine = LuaEngine<>(L).regType<Shape>("Shape");
+		engine.regConstructor<Shape (float)>("Shape").regMethod("area", &Shape::getArea)
+			.regFunc("makeShape", &makeShape).regFunc("describePair", &describePair)
+			.regOverload("describe", &describeInt).regOverload("describe", &describeText)
+			.regMeta("Shape", "__add", &addAreas).regProfiler("profile");
+		execLuaString(L,
+			"for i = 1, 10 do assert(makeShape(i):area() == i) end\n"
+			"assert(not pcall(describePair, 'x', 1)) describePair(1, 2)\n"
+			"describe(1) describe('x') assert(not pcall(describe, {}))\n"
+			"assert(Shape(1) + Shape(2) == 3)\n"
+			"local p = profile()\n"
+			"assert(p.makeShape.calls == 10 and p.makeShape.allocations == 10)\n"
+			"assert(p['Shape:area'].calls == 10 and p['Shape:area'].allocations == 0)\n"
+			"assert(p.describePair.calls == 2 and p.describePair.convertErrors == 1)\n"
+			"assert(p.describe.calls == 3 and p.describe.convertErrors == 1)\n"
+			"assert(p.Shape.calls == 2 and p.Shape.allocations == 2 and p['Shape.__add'].calls == 1)\n"
+			"assert(p.makeShape.time > 0 and p.makeShape.maxTime <= p.makeShape.time)");
+		std::vector<LuaBindingStats> stats = engine.profile();
+		LUABINDER_CHECK(!stats.empty());
+		for (std::size_t i = 1; i < stats.size(); ++i)
+			LUABINDER_CHECK(stats[i - 1].totalNanos >= stats[i].totalNanos);
+		engine.resetProfile();
+		stats = engine.profile();
+		for (std::size_t i = 0; i < stats.size(); ++i)
+			LUABINDER_CHECK(stats[i].calls == 0 && stats[i].totalNanos == 0 && !stats[i].name.empty());
+	}
+#endif
+
+	struct TestCase
+	{
+		const char* name;
+		void (*run)();
+	};
+
+	const TestCase tests[] = {
+		{ "branchingRegistration", & branchingRegistration },
+		{ "truncatedChunkCache", & truncatedChunkCache },
+		{ "corruptChunkLength", & corruptChunkLength },
+		{ "chunkCacheEviction", & chunkCacheEviction },
+		{ "scalarResults", & scalarResults },
+		{ "pointerOutParams", & pointerOutParams },
+		{ "propertyKeepsOwner", & propertyKeepsOwner },
+		{ "arenaResetAfterClose", & arenaResetAfterClose },
+		{ "watchdogCoroutines", & watchdogCoroutines },
+		{ "registrationTeardown", & registrationTeardown },
+		{ "cachedPointerIdentity", & cachedPointerIdentity },
+		{ "borrowedPointers", & borrowedPointers },
+		{ "luaFunctionResults", & luaFunctionResults },
+		{ "arrayViewOperations", & arrayViewOperations },
+		{ "containerRoundTrips", & containerRoundTrips },
+		{ "embeddedZeros", & embeddedZeros },
+		{ "metamethodInheritance", & metamethodInheritance },
+		{ "overloadDispatch", & overloadDispatch },
+#ifdef LUABINDER_ENGINE_POOL
+		{ "enginePool", & enginePool },
+#endif
+#ifdef LUABINDER_PROFILE
+		{ "profilerCounters", & profilerCounters },
+#endif
+	};
+}
+
+int main()
+{
+	int failed = 0;
+	for (std::size_t i = 0; i < sizeof (tests) / sizeof (tests[0]); ++i)
+	{
+		try
+		{
+			tests[i].run();
+			std::printf("ok      %s\n", tests[i].name);
+			continue;
+		}
+		catch (TestFailure& e)
+		{
+			std::printf("FAILED  %s: %s\n", tests[i].name, e.what.c_str());
+		}
+		catch (LuaException& e)
+		{
+			std::printf("FAILED  %s: %s\n", tests[i].name, e.what.c_str());
+		}
+		++failed;
+	}
+	return failed ? 1 : 0;
+}